@@ -5,13 +5,91 @@
 #include <stdio.h>
 #include <string.h>
 
-MyIStream::MyIStream(const char* fileName)
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+
+// Maps whole file read-only; returns null on failure (or if the file is empty)
+static const char* MapFile(const char* fileName, size_t& r_size)
+{
+    const char* ptr = nullptr;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+    {
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping != nullptr)
+        {
+            ptr = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping); // the view keeps the mapping alive
+            r_size = size_t(size.QuadPart);
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* map = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            // decoders mostly read front to back; also start paging the file in right away
+            madvise(map, size_t(st.st_size), MADV_SEQUENTIAL);
+            madvise(map, size_t(st.st_size), MADV_WILLNEED);
+            ptr = (const char*)map;
+            r_size = size_t(st.st_size);
+        }
+    }
+    close(fd); // the mapping stays valid after closing
+#endif
+    return ptr;
+}
+
+static void UnmapFile(const char* ptr, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(ptr);
+#else
+    munmap((void*)ptr, size);
+#endif
+}
+
+MyIStream::MyIStream(const char* fileName, bool memory_map)
 	:
 #ifdef INCLUDE_FORMAT_EXR
     IStream("<memory>"),
 #endif
     _buffer(nullptr), _pos(0), _size(0), _owns_buffer(true)
 {
+    if (memory_map)
+    {
+        _buffer = MapFile(fileName, _size);
+        if (_buffer != nullptr)
+        {
+            _owns_buffer = false;
+            _mapped = true;
+            return;
+        }
+        // could not map (e.g. empty file), read it instead
+    }
+
     FILE* f = fopen(fileName, "rb");
     if (f == nullptr)
     {
@@ -34,6 +112,8 @@ MyIStream::~MyIStream()
 {
     if (_owns_buffer)
         delete[] _buffer;
+    if (_mapped)
+        UnmapFile(_buffer, _size);
 }
 
 bool MyIStream::read (char c[/*n*/], int n)
@@ -71,29 +151,90 @@ void MyIStream::clear ()
 {
 }
 
-MyOStream::MyOStream()
+constexpr size_t kMinSegmentSize = 1024 * 1024;
+
+MyOStream::MyOStream(size_t size_hint)
     :
 #ifdef INCLUDE_FORMAT_EXR
     OStream("<mem>"),
 #endif
-    _pos(0)
+    _size(0), _pos(0)
 {
-    _buffer.reserve(16 * 1024 * 1024);
+    if (size_hint != 0)
+        add_segment(size_hint);
+}
+
+void MyOStream::add_segment(size_t capacity)
+{
+    Segment seg;
+    seg.data.reset(new char[capacity]);
+    seg.start = this->capacity();
+    seg.capacity = capacity;
+    _segments.emplace_back(std::move(seg));
+}
+
+void MyOStream::reserve(size_t size)
+{
+    if (size <= capacity())
+        return;
+    if (_segments.empty() || _segments.back().start >= _size)
+    {
+        // no data in last segment (or no segments at all): just add one
+        if (!_segments.empty())
+            _segments.pop_back();
+        add_segment(size - capacity());
+        return;
+    }
+    // grow the last segment, so that it does not get split into a partially used one and a new one;
+    // only data in the last segment is copied
+    Segment& last = _segments.back();
+    const size_t new_capacity = size - last.start;
+    std::unique_ptr<char[]> data(new char[new_capacity]);
+    memcpy(data.get(), last.data.get(), std::min(_size - last.start, last.capacity));
+    last.data = std::move(data);
+    last.capacity = new_capacity;
 }
 
 void MyOStream::write (const char c[/*n*/], int n)
 {
-    if (_pos == _buffer.size())
+    if (n <= 0)
+        return;
+    if (_pos > _size)
     {
-        _buffer.insert(_buffer.end(), c, c + n);
+        // seeked past the end: zero-fill the gap, so that output is deterministic
+        static const char kZeroes[4096] = {};
+        const size_t pos = _pos;
+        _pos = _size;
+        while (_pos < pos)
+            write(kZeroes, int(std::min(pos - _pos, sizeof(kZeroes))));
     }
-    else
+    const size_t end = _pos + n;
+    if (end > capacity())
     {
-        if (_pos + n > _buffer.size())
-            _buffer.resize(_pos + n);
-        memcpy(_buffer.data() + _pos, c, n);
+        // double the total capacity, without touching existing data
+        const size_t total = capacity();
+        add_segment(std::max(std::max(end - total, total), kMinSegmentSize));
     }
-    _pos += n;
+
+    // find segment for current position; usually the last one
+    size_t seg_index = _segments.size() - 1;
+    while (_segments[seg_index].start > _pos)
+        --seg_index;
+    size_t pos = _pos;
+    while (n > 0)
+    {
+        Segment& seg = _segments[seg_index];
+        const size_t offset = pos - seg.start;
+        const size_t count = std::min(size_t(n), seg.capacity - offset);
+        memcpy(seg.data.get() + offset, c, count);
+        c += count;
+        n -= int(count);
+        pos += count;
+        ++seg_index;
+    }
+    _pos = end;
+    if (end > _size)
+        _size = end;
 }
 
 uint64_t MyOStream::tellp()
@@ -103,9 +244,80 @@ uint64_t MyOStream::tellp()
 
 void MyOStream::seekp (uint64_t pos)
 {
-    if (pos > _buffer.size())
+    if (pos > _size)
     {
-        printf("wat? seeking %zi but buffer size is %zi\n", (size_t)pos, _buffer.size());
+        printf("wat? seeking %zi but buffer size is %zi\n", (size_t)pos, _size);
     }
     _pos = pos;
 }
+
+const char* MyOStream::data()
+{
+    if (_segments.size() > 1)
+    {
+        Segment merged;
+        merged.data.reset(new char[_size]);
+        merged.start = 0;
+        merged.capacity = _size;
+        for (const Segment& seg : _segments)
+        {
+            if (seg.start < _size)
+                memcpy(merged.data.get() + seg.start, seg.data.get(), std::min(seg.capacity, _size - seg.start));
+        }
+        _segments.clear();
+        _segments.emplace_back(std::move(merged));
+    }
+    return _segments.empty() ? nullptr : _segments[0].data.get();
+}
+
+bool MyOStream::write_file(const char* fileName) const
+{
+#ifdef _WIN32
+    FILE* f = fopen(fileName, "wb");
+    if (f == nullptr)
+        return false;
+    bool ok = true;
+    for (const Segment& seg : _segments)
+    {
+        if (seg.start < _size)
+        {
+            const size_t count = std::min(seg.capacity, _size - seg.start);
+            ok &= fwrite(seg.data.get(), 1, count, f) == count;
+        }
+    }
+    ok &= fclose(f) == 0;
+    return ok;
+#else
+    int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    std::vector<iovec> iov;
+    for (const Segment& seg : _segments)
+    {
+        if (seg.start < _size)
+            iov.push_back({seg.data.get(), std::min(seg.capacity, _size - seg.start)});
+    }
+    // writev can write less than asked; continue from where it stopped
+    bool ok = true;
+    size_t first = 0;
+    while (ok && first < iov.size())
+    {
+        const ssize_t written = writev(fd, iov.data() + first, int(std::min(iov.size() - first, size_t(IOV_MAX))));
+        if (written < 0)
+        {
+            ok = false;
+            break;
+        }
+        size_t left = size_t(written);
+        while (first < iov.size() && left >= iov[first].iov_len)
+            left -= iov[first++].iov_len;
+        if (left > 0)
+        {
+            iov[first].iov_base = (char*)iov[first].iov_base + left;
+            iov[first].iov_len -= left;
+        }
+    }
+    ok &= close(fd) == 0;
+    return ok;
+#endif
+}
@@ -1,6 +1,8 @@
 #pragma once
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdio.h>
+#include <stdint.h>
+#include <memory>
 #include <vector>
 #ifdef INCLUDE_FORMAT_EXR
 #include "ImfIO.h"
@@ -12,7 +14,9 @@ class MyIStream
 #endif
 {
 public:
-    MyIStream(const char* fileName);
+    // Reads the whole file into memory; with memory_map the file is mapped
+    // read-only instead, and data() points directly into the mapping.
+    MyIStream(const char* fileName, bool memory_map = false);
     MyIStream(const char* buffer, size_t size)
         :
 #ifdef INCLUDE_FORMAT_EXR
@@ -36,6 +40,7 @@ private:
 	size_t _pos;
     size_t _size;
     bool _owns_buffer = false;
+    bool _mapped = false;
 };
 
 class MyOStream
@@ -44,7 +49,9 @@ class MyOStream
 #endif
 {
 public:
-    MyOStream();
+    // size_hint: expected total output size, allocated up front. Data is stored in
+    // uninitialized segments that are never reallocated, only added when full.
+    MyOStream(size_t size_hint = 0);
     ~MyOStream() {}
 
     virtual void write(const char c[/*n*/], int n);
@@ -54,9 +61,29 @@ public:
     template<typename T>
     void write(const T& v) { write((const char*)&v, sizeof(v)); }
 
-    const char* data() const { return _buffer.data(); }
-    size_t size() const { return _buffer.size(); }
+    // Makes sure total output of size bytes fits without adding more segments.
+    void reserve(size_t size);
+
+    // Contiguous output data; merges the segments into one if there are several,
+    // which is why this is not const.
+    const char* data();
+    size_t size() const { return _size; }
+
+    // Writes the output into a file (gathering all segments in one writev call where available).
+    bool write_file(const char* fileName) const;
+
 private:
-    std::vector<char> _buffer;
+    struct Segment
+    {
+        std::unique_ptr<char[]> data;
+        size_t start; // offset of this segment within the whole output
+        size_t capacity;
+    };
+    void add_segment(size_t capacity);
+    size_t capacity() const { return _segments.empty() ? 0 : _segments.back().start + _segments.back().capacity; }
+
+    // all segments except the last one are full
+    std::vector<Segment> _segments;
+    size_t _size;
     size_t _pos;
 };
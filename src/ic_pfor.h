@@ -1,5 +1,10 @@
 // ic_pfor v1.0 - Ignacio Castano <castano@gmail.com>
-// Local modifications: make the parallel for lambda accept the thread index argument.
+// Local modifications: make the parallel for lambda accept the thread index argument;
+// replace the single job thread pool with a work stealing scheduler that supports
+// nested and concurrent parallel for calls, plus task groups and current thread index query;
+// guided scheduling with automatic range size, and contiguous per-thread range schedule;
+// spin before sleeping in idle threads; per-thread init callback (e.g. for CPU pinning);
+// pool statistics.
 // LICENSE:
 //  MIT License at the end of this file.
 
@@ -17,28 +22,102 @@
 #endif
 #endif
 
+#include <atomic>
+
 namespace ic {
 
     // Init and destroy this library. Returns number of threads.
-    int init_pfor(int worker_count = 0, bool use_calling_thread = true);
+    // Thread indices passed to tasks are in [0, thread count) range, and no two threads
+    // run tasks with the same index at the same time. With use_calling_thread, index 0
+    // is used by one of the (non-pool) threads that call into the library at a time;
+    // other such threads just wait for their work to be done.
+    // Each pool thread calls thread_init (if given) when it starts, before running any tasks.
+    typedef void ThreadInit(void * context, int thread_idx);
+    int init_pfor(int worker_count = 0, bool use_calling_thread = true, ThreadInit * thread_init = 0, void * thread_init_context = 0);
     void shut_pfor();
 
+    // Thread index of the calling thread if it is a pool thread (or is a calling thread
+    // currently running tasks as index 0), -1 otherwise.
+    int current_thread_index();
+
+    // Pool statistics, collected since init_pfor or the last reset_stats call. Times are
+    // measured only for the outermost task on each thread, so waiting for nested work
+    // inside a task counts as busy time.
+    struct ThreadStats {
+        unsigned long long tasks;   // parallel for entries and task group tasks run
+        double busy_time;           // seconds spent running tasks
+        double idle_time;           // seconds spent waiting for tasks to run
+    };
+    struct ForStats {
+        unsigned long long count;   // parallel for calls, including nested ones
+        double time;                // seconds from start to end of the calls
+        double tail_time;           // seconds from the first thread running out of work until the end
+    };
+    // Fills stats for up to max_threads thread indices, and for_stats if not null.
+    // Returns the thread count.
+    int get_stats(ThreadStats * thread_stats, int max_threads, ForStats * for_stats);
+    void reset_stats();
+
     // Invoke the given function pointer in parallel with idx values in the [0,count) range.
+    // Can be called from several threads at once, and from inside other tasks. While waiting
+    // for completion, the calling thread runs other queued tasks with the same thread index,
+    // so per-thread-index data must not be kept in use across a nested pfor call.
+    //
+    // Threads take ranges of step indices at a time. With step 0 the range size is picked
+    // automatically: ranges start large and get smaller towards the end (guided scheduling),
+    // down to a minimum size that depends on count and thread count.
+    enum Schedule {
+        // Any thread takes the next range in index order.
+        ScheduleDynamic,
+        // Each thread gets its own contiguous part of the index range and goes through it
+        // in order; threads that are done take half of what is left in another thread's part.
+        ScheduleContiguous,
+    };
     typedef void ForTask(void * context, int idx, int thread_idx);
-    void pfor_run (ForTask * task, void * context, unsigned int count, unsigned int step = 1);
+    void pfor_run (ForTask * task, void * context, unsigned int count, unsigned int step = 1, Schedule schedule = ScheduleDynamic);
+
+    // Group of independent tasks; wait() returns once all the tasks spawned into
+    // the group are done (and helps running queued tasks meanwhile).
+    typedef void Task(void * context, int thread_idx);
+    struct TaskGroup {
+        TaskGroup() : pending(0) {}
+        ~TaskGroup() { wait(); }
+
+        // Context has to stay valid until the task is done.
+        void run(Task * task, void * context);
+        void wait();
+
+#if IC_CC_LAMBDAS
+        // group.spawn([=](int thread_idx){ ... });
+        template <typename F>
+        void spawn(F f) {
+            auto lambda = [](void* context, int thread_idx) {
+                F * f = reinterpret_cast<F *>(context);
+                (*f)(thread_idx);
+                delete f;
+            };
+            run(lambda, new F(f));
+        }
+#endif
+
+        std::atomic<int> pending;
+    private:
+        TaskGroup(const TaskGroup&);
+        TaskGroup& operator=(const TaskGroup&);
+    };
 
 #if IC_CC_LAMBDAS
     // The lambda based body declaration is much nicer:
     // ic::pfor(count, step, [&](int i){ ... });
     template <typename F>
-    void pfor(unsigned int count, unsigned int step, F f) {
+    void pfor(unsigned int count, unsigned int step, F f, Schedule schedule = ScheduleDynamic) {
         // Transform lambda into function pointer.
         auto lambda = [](void* context, int idx, int thread_idx) {
             F & f = *reinterpret_cast<F *>(context);
             f(idx, thread_idx);
         };
 
-        pfor_run(lambda, &f, count, step);
+        pfor_run(lambda, &f, count, step, schedule);
     }
 
     // Some shenanigas for a slightly better syntax:
@@ -81,6 +160,17 @@ namespace ic {
 #define IC_THREAD_STACK_SIZE 0 // Use default size.
 #endif
 
+// Number of times idle threads check for new work (or task completion) before going to sleep.
+// Spinning is disabled when there are more threads than processors.
+#ifndef IC_SPIN_COUNT
+#define IC_SPIN_COUNT 4000
+#endif
+
+// Set this to 0 to not collect pool statistics (get_stats returns zeros then).
+#ifndef IC_POOL_STATS
+#define IC_POOL_STATS 1
+#endif
+
 // Set this to 1 to use the Windows CRT safely inside the threads.
 #ifndef IC_INIT_THREAD_CRT
 #define IC_INIT_THREAD_CRT 0
@@ -145,6 +235,11 @@ namespace ic {
 #include <stdint.h>
 #include <stdio.h> // snprintf
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
 
 
 #define IC_MAX_THREAD_NAME_LENGTH 32
@@ -162,78 +257,13 @@ inline T min(const T & a, const T & b)
     return (a < b) ? a : b;
 }
 
-
-
-////////////////////////////////////////////////////////
-// Atomics
-
-#if _MSC_VER
-
-#include <intrin.h>
-
-#pragma intrinsic(__cpuid)
-#pragma intrinsic(_WriteBarrier)
-#define compiler_write_barrier      _WriteBarrier
-
-#pragma intrinsic(_ReadWriteBarrier)
-#define compiler_rw_barrier         _ReadWriteBarrier
-
-#if _MSC_VER >= 1400  // ReadBarrier is VC2005
-#pragma intrinsic(_ReadBarrier)
-#define compiler_read_barrier       _ReadBarrier
-#else
-#define compiler_read_barrier       _ReadWriteBarrier
-#endif
-
-#else // GCC
-
-#define compiler_rw_barrier()       asm volatile("" ::: "memory")
-#define compiler_read_barrier       compiler_rw_barrier
-#define compiler_write_barrier      compiler_rw_barrier
-
-#endif
-
-template <typename T>
-inline void store_release_pointer(volatile T * pTo, T from) {
-    IC_STATIC_ASSERT(sizeof(T) == sizeof(intptr_t));
-    IC_ASSERT((((intptr_t)pTo) % sizeof(intptr_t)) == 0);
-    IC_ASSERT((((intptr_t)&from) % sizeof(intptr_t)) == 0);
-
-    compiler_write_barrier();
-    *pTo = from;    // on x86, stores are Release
-}
-
+/// Return the maximum of two values.
 template <typename T>
-inline T load_acquire_pointer(volatile T * ptr) {
-    IC_STATIC_ASSERT(sizeof(T) == sizeof(intptr_t));
-    IC_ASSERT((((intptr_t)ptr) % sizeof(intptr_t)) == 0);
-
-    T ret = *ptr;   // on x86, loads are Acquire
-    compiler_read_barrier();
-    return ret;
-}
-
-#undef compiler_rw_barrier
-#undef compiler_read_barrier
-#undef compiler_write_barrier
-
-#if IC_OS_WINDOWS
-
-// Returns original value before addition.
-inline uint32 atomic_fetch_and_add(uint32 * value, uint32 value_to_add) {
-    IC_ASSERT((intptr_t(value) & 3) == 0);
-    return uint32(_InterlockedExchangeAdd((long*)value, (long)value_to_add));
-}
-
-#else
-
-// Returns original value before addition.
-inline uint32 atomic_fetch_and_add(uint32 * value, uint32 value_to_add) {
-    IC_ASSERT((intptr_t(value) & 3) == 0);
-    return __sync_fetch_and_add(value, value_to_add);
+inline T max(const T & a, const T & b)
+{
+    return (a > b) ? a : b;
 }
 
-#endif
 
 
 ////////////////////////////////////////////////////////
@@ -458,158 +488,289 @@ static void thread_wait(Thread threads[], uint count)
 
 
 ////////////////////////////////////////////////////////
-// Event
+// Task Scheduler
+//
+// Each thread index ("slot") has a task queue; the owner takes tasks from the back,
+// other slots steal from the front. Threads without a slot put their tasks into a
+// shared queue. A parallel for is one job queued several times; whoever picks up an
+// entry grabs index ranges from the job until there are none left.
+
+struct QueuedTask {
+    void (*execute)(QueuedTask * task, int slot);
+};
 
-#if IC_OS_WINDOWS
+struct TaskQueue {
+    std::mutex mutex;
+    std::deque<QueuedTask *> tasks;
+};
 
-struct Event {
-    HANDLE handle;
+struct SlotStats {
+    std::atomic<uint64_t> tasks;
+    std::atomic<uint64_t> busy_ns;
+    std::atomic<uint64_t> idle_ns;
 };
 
-static void event_create(Event * event)
-{
-    event->handle = CreateEvent(/*lpEventAttributes=*/NULL, /*bManualReset=*/FALSE, /*bInitialState=*/FALSE, /*lpName=*/NULL);
-}
+struct TaskPool {
+    bool use_calling_thread;
+    int worker_count; // total slots, including the calling thread one
+    int thread_count; // actually created threads
 
-static void event_destroy(Event * event)
-{
-    CloseHandle(event->handle);
-    event->handle = NULL;
-}
+    Thread workers[IC_MAX_THREAD_COUNT];
+    TaskQueue queues[IC_MAX_THREAD_COUNT + 1];
+    TaskQueue shared_queue; // tasks from threads that have no slot
+
+    std::atomic<bool> calling_slot_busy; // slot 0 taken by some calling thread?
+
+    // sleeping: workers wait for new tasks, waiters for task completion; epoch changes on both.
+    // Sleeping counts are changed under the mutex, but read without it, so that notifying
+    // does not need the mutex when nobody sleeps.
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable wait_cv;
+    std::atomic<uint64_t> epoch;
+    std::atomic<int> sleeping_workers;
+    std::atomic<int> sleeping_waiters;
+    int spin_count;
+    bool shutdown;
+
+    ThreadInit * thread_init;
+    void * thread_init_context;
+
+    SlotStats stats[IC_MAX_THREAD_COUNT + 1];
+    std::atomic<uint64_t> for_count;
+    std::atomic<uint64_t> for_ns;
+    std::atomic<uint64_t> for_tail_ns;
+};
 
-static void event_post(Event * event)
-{
-    SetEvent(event->handle);
-}
+static TaskPool pool;
+static thread_local int s_slot = -1; // slot of the current thread, -1 if it has none
+static thread_local int s_task_depth = 0; // tasks being run by the current thread
 
-static void event_wait(Event * event)
-{
-    WaitForSingleObject(event->handle, INFINITE);
+static inline uint64_t time_ns() {
+#if IC_POOL_STATS
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#else
+    return 0;
+#endif
 }
 
-#else // POSIX
-
-struct Event {
-    pthread_cond_t pt_cond;
-    pthread_mutex_t pt_mutex;
-    int count = 0;
-    int wait_count = 0;
-};
-
-static void event_create(Event * event)
-{
-    event->count = 0;
-    event->wait_count = 0;
-    pthread_mutex_init(&event->pt_mutex, NULL);
-    pthread_cond_init(&event->pt_cond, NULL);
+static void run_task(QueuedTask * task, int slot) {
+    SlotStats & stats = pool.stats[slot];
+    stats.tasks.fetch_add(1, std::memory_order_relaxed);
+    const bool outermost = s_task_depth++ == 0;
+    const uint64_t start = outermost ? time_ns() : 0;
+    task->execute(task, slot);
+    if (outermost) {
+        stats.busy_ns.fetch_add(time_ns() - start, std::memory_order_relaxed);
+    }
+    s_task_depth--;
 }
 
-static void event_destroy(Event * event)
-{
-    pthread_cond_destroy(&event->pt_cond);
-    pthread_mutex_destroy(&event->pt_mutex);
+static inline void add_idle_time(uint64_t start) {
+    if (s_slot >= 0 && s_task_depth == 0) {
+        pool.stats[s_slot].idle_ns.fetch_add(time_ns() - start, std::memory_order_relaxed);
+    }
 }
 
-static void event_post(Event * event)
-{
-    pthread_mutex_lock(&event->pt_mutex);
-
-    event->count += 1;
-
-    if (event->wait_count > 0) {
-        pthread_cond_signal(&event->pt_cond);
+static void push_tasks(QueuedTask * task, uint count) {
+    if (count == 0) {
+        return;
+    }
+    TaskQueue & queue = s_slot >= 0 ? pool.queues[s_slot] : pool.shared_queue;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for (uint i = 0; i < count; i++) {
+            queue.tasks.push_back(task);
+        }
     }
 
-    pthread_mutex_unlock(&event->pt_mutex);
+    // sleepers increment their count and then check the epoch, so either they
+    // see the new epoch, or this sees them sleeping
+    pool.epoch++;
+    const bool workers_asleep = pool.sleeping_workers.load() > 0;
+    const bool waiters_asleep = pool.sleeping_waiters.load() > 0;
+    if (!workers_asleep && !waiters_asleep) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (workers_asleep) {
+        if (count == 1) {
+            pool.work_cv.notify_one();
+        }
+        else {
+            pool.work_cv.notify_all();
+        }
+    }
+    // waiting threads might be able to help
+    if (waiters_asleep) {
+        pool.wait_cv.notify_all();
+    }
 }
 
-static void event_wait(Event * event)
-{
-    pthread_mutex_lock(&event->pt_mutex);
-
-    while (event->count == 0) {
-        event->wait_count += 1;
-        pthread_cond_wait(&event->pt_cond, &event->pt_mutex);
-        event->wait_count -= 1;
+static void notify_waiters() {
+    pool.epoch++;
+    if (pool.sleeping_waiters.load() > 0) {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.wait_cv.notify_all();
     }
-    event->count -= 1;
-
-    pthread_mutex_unlock(&event->pt_mutex);
 }
 
+static inline void cpu_pause() {
+#if IC_OS_WINDOWS
+    YieldProcessor();
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+    __builtin_ia32_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__aarch64__) || defined(__arm__))
+    __asm__ __volatile__("yield");
 #endif
+}
 
-static void event_post(Event threads[], uint count)
-{
-    for (uint i = 0; i < count; i++) {
-        event_post(&threads[i]);
+// Spins until epoch changes or counter (if any) gets to zero. Returns false if that
+// did not happen within the spin count, and the thread should go to sleep.
+static bool spin_wait(uint64_t epoch, const std::atomic<int> * counter) {
+    for (int i = 0; i < pool.spin_count; i++) {
+        if (pool.epoch.load(std::memory_order_relaxed) != epoch || (counter != NULL && counter->load(std::memory_order_relaxed) == 0)) {
+            return true;
+        }
+        cpu_pause();
     }
+    return false;
 }
 
-static void event_wait(Event threads[], uint count)
-{
-    for (uint i = 0; i < count; i++) {
-        event_wait(&threads[i]);
+static QueuedTask * find_task(int slot) {
+    // own queue first (most recently pushed), then steal oldest from others
+    {
+        TaskQueue & queue = pool.queues[slot];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            QueuedTask * task = queue.tasks.back();
+            queue.tasks.pop_back();
+            return task;
+        }
+    }
+    for (int i = 1; i <= pool.worker_count; i++) {
+        const int victim = (slot + i) % (pool.worker_count + 1);
+        TaskQueue & queue = victim == pool.worker_count ? pool.shared_queue : pool.queues[victim];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            QueuedTask * task = queue.tasks.front();
+            queue.tasks.pop_front();
+            return task;
+        }
     }
+    return NULL;
 }
 
+int current_thread_index() {
+    return s_slot;
+}
 
-////////////////////////////////////////////////////////
-// Thread Pool
-
-typedef void ThreadTask(void * context, int id);
-
-struct ThreadPool {
-    bool use_calling_thread;
-    int worker_count;
-
-    Thread workers[IC_MAX_THREAD_COUNT];
-    Event startEvents[IC_MAX_THREAD_COUNT];
-    Event finishEvents[IC_MAX_THREAD_COUNT];
-
-    ThreadTask * func;
-    void * arg;
-};
-
-static ThreadPool pool;
+int get_stats(ThreadStats * thread_stats, int max_threads, ForStats * for_stats) {
+    for (int i = 0; i < min(max_threads, pool.worker_count); i++) {
+        const SlotStats & stats = pool.stats[i];
+        thread_stats[i].tasks = stats.tasks.load(std::memory_order_relaxed);
+        thread_stats[i].busy_time = stats.busy_ns.load(std::memory_order_relaxed) * 1e-9;
+        thread_stats[i].idle_time = stats.idle_ns.load(std::memory_order_relaxed) * 1e-9;
+    }
+    if (for_stats != NULL) {
+        for_stats->count = pool.for_count.load(std::memory_order_relaxed);
+        for_stats->time = pool.for_ns.load(std::memory_order_relaxed) * 1e-9;
+        for_stats->tail_time = pool.for_tail_ns.load(std::memory_order_relaxed) * 1e-9;
+    }
+    return pool.worker_count;
+}
 
-static void pool_func(void * arg) {
-    uint i = uint((uintptr_t)arg); // This is OK, because workerCount should always be much smaller than 2^32
+void reset_stats() {
+    for (int i = 0; i < IC_MAX_THREAD_COUNT + 1; i++) {
+        pool.stats[i].tasks.store(0);
+        pool.stats[i].busy_ns.store(0);
+        pool.stats[i].idle_ns.store(0);
+    }
+    pool.for_count.store(0);
+    pool.for_ns.store(0);
+    pool.for_tail_ns.store(0);
+}
 
-    while (true)
-    {
-        event_wait(&pool.startEvents[i]);
+// Calling (non pool) threads can use slot 0, one at a time.
+static bool acquire_calling_slot() {
+    if (s_slot >= 0 || !pool.use_calling_thread || pool.calling_slot_busy.exchange(true)) {
+        return false;
+    }
+    s_slot = 0;
+    return true;
+}
 
-        ThreadTask * func = load_acquire_pointer(&pool.func);
+static void release_calling_slot() {
+    s_slot = -1;
+    pool.calling_slot_busy.store(false);
+    notify_waiters(); // some other calling thread might be waiting to get the slot
+}
 
-        if (func == NULL) {
-            return;
+// Waits until counter gets to zero, running other tasks meanwhile if this thread has a slot.
+static void wait_until_zero(const std::atomic<int> & counter) {
+    bool acquired = false;
+    while (counter.load() != 0) {
+        const uint64_t epoch = pool.epoch.load();
+        if (s_slot < 0) {
+            acquired = acquire_calling_slot();
         }
-
-        func(pool.arg, i + pool.use_calling_thread);
-
-        event_post(&pool.finishEvents[i]);
+        if (s_slot >= 0) {
+            QueuedTask * task = find_task(s_slot);
+            if (task != NULL) {
+                run_task(task, s_slot);
+                continue;
+            }
+        }
+        const uint64_t idle_start = time_ns();
+        if (!spin_wait(epoch, &counter)) {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.sleeping_waiters++;
+            while (counter.load() != 0 && pool.epoch.load() == epoch) {
+                pool.wait_cv.wait(lock);
+            }
+            pool.sleeping_waiters--;
+        }
+        add_idle_time(idle_start);
+    }
+    if (acquired) {
+        release_calling_slot();
     }
 }
 
-void thread_pool_run(ThreadTask * func, void * arg)
-{
-    // Set our desired function.
-    store_release_pointer(&pool.func, func);
-    store_release_pointer(&pool.arg, arg);
+static void worker_func(void * arg) {
+    s_slot = int((uintptr_t)arg);
+    if (pool.thread_init != NULL) {
+        pool.thread_init(pool.thread_init_context, s_slot);
+    }
 
-    // Resume threads.
-    event_post(pool.startEvents, pool.worker_count - pool.use_calling_thread);
+    while (true) {
+        const uint64_t epoch = pool.epoch.load();
+        QueuedTask * task = find_task(s_slot);
+        if (task != NULL) {
+            run_task(task, s_slot);
+            continue;
+        }
+        const uint64_t idle_start = time_ns();
+        if (spin_wait(epoch, NULL)) {
+            add_idle_time(idle_start);
+            continue;
+        }
 
-    if (pool.use_calling_thread) {
-        func(arg, 0);
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.sleeping_workers++;
+        while (!pool.shutdown && pool.epoch.load() == epoch) {
+            pool.work_cv.wait(lock);
+        }
+        pool.sleeping_workers--;
+        if (pool.shutdown) {
+            return;
+        }
+        lock.unlock();
+        add_idle_time(idle_start);
     }
-
-    // Wait for threads to complete.
-    event_wait(pool.finishEvents, pool.worker_count - pool.use_calling_thread);
 }
 
-int init_pfor(int worker_count, bool use_calling_thread) {
+int init_pfor(int worker_count, bool use_calling_thread, ThreadInit * thread_init, void * thread_init_context) {
 
     if (worker_count <= 0) {
         worker_count = get_processor_count();
@@ -620,15 +781,20 @@ int init_pfor(int worker_count, bool use_calling_thread) {
 
     pool.worker_count = worker_count;
     pool.use_calling_thread = use_calling_thread;
-
-    for (int i = 0; i < worker_count - use_calling_thread; i++) {
-        event_create(&pool.startEvents[i]);
-        event_create(&pool.finishEvents[i]);
-    }
-
-    for (int i = 0; i < worker_count - use_calling_thread; i++) {
+    pool.thread_count = worker_count - use_calling_thread;
+    pool.calling_slot_busy.store(false);
+    pool.epoch.store(0);
+    pool.sleeping_workers.store(0);
+    pool.sleeping_waiters.store(0);
+    pool.spin_count = worker_count <= get_processor_count() ? IC_SPIN_COUNT : 0;
+    pool.shutdown = false;
+    pool.thread_init = thread_init;
+    pool.thread_init_context = thread_init_context;
+    reset_stats();
+
+    for (int i = 0; i < pool.thread_count; i++) {
         snprintf(pool.workers[i].name, IC_MAX_THREAD_NAME_LENGTH, "ic_pfor_worker %d", i);
-        thread_start(&pool.workers[i], pool_func, (void*)(uintptr_t)(i));
+        thread_start(&pool.workers[i], worker_func, (void*)(uintptr_t)(i + use_calling_thread));
     }
 
     return worker_count;
@@ -636,65 +802,229 @@ int init_pfor(int worker_count, bool use_calling_thread) {
 
 void shut_pfor() {
 
-    // Set threads to terminate.
-    store_release_pointer(&pool.func, (ThreadTask *)NULL);
-    store_release_pointer(&pool.arg, (void *)NULL);
-
-    // Resume threads.
-    event_post(pool.startEvents, pool.worker_count - pool.use_calling_thread);
-
-    // Wait until threads actually exit.
-    thread_wait(pool.workers, pool.worker_count - pool.use_calling_thread);
-
-    for (int i = 0; i < pool.worker_count - pool.use_calling_thread; i++) {
-        event_destroy(&pool.startEvents[i]);
-        event_destroy(&pool.finishEvents[i]);
+    // Set threads to terminate, and wait until they actually exit.
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.shutdown = true;
+        pool.work_cv.notify_all();
     }
+    thread_wait(pool.workers, pool.thread_count);
+    pool.thread_count = 0;
+    pool.worker_count = 0;
 }
 
 
 ////////////////////////////////////////////////////////
 // Parallel For
 
-struct ParallelFor {
+struct ForJob : QueuedTask {
     ForTask * func;
     void * ctx;
 
     uint count;
-    uint step;
-    /*atomic*/ uint idx;
+    uint step;      // 0 for guided ranges
+    uint grain;     // minimum range size
+    uint entries;   // number of queue entries
+    Schedule schedule;
+    std::atomic<uint> idx;
+    std::atomic<int> refs; // queue entries (and the calling thread) not done yet
+    std::atomic<uint64_t> first_done_ns; // when the first entry ran out of work, 0 if none did yet
+
+    // ScheduleContiguous: [begin, end) range left in each part, begin in low 32 bits
+    std::atomic<uint> next_part;
+    std::atomic<uint64_t> parts[IC_MAX_THREAD_COUNT + 1];
 };
 
-static ParallelFor pf;
+static void pf_run_range(ForJob * job, uint begin, uint end, int tid) {
+    for (uint i = begin; i < end; i++) {
+        job->func(job->ctx, i, tid);
+    }
+}
 
-static void pf_func(void * arg, int tid) {
+static void pf_dynamic(ForJob * job, int tid) {
     while (true) {
-        uint new_idx = atomic_fetch_and_add(&pf.idx, pf.step);
-        if (new_idx >= pf.count) {
+        uint new_idx = job->idx.fetch_add(job->step);
+        if (new_idx >= job->count) {
             break;
         }
+        pf_run_range(job, new_idx, min(job->count, new_idx + job->step), tid);
+    }
+}
 
-        const uint count = min(pf.count, new_idx + pf.step);
-        for (uint i = new_idx; i < count; i++) {
-            pf.func(pf.ctx, i, tid);
+static void pf_guided(ForJob * job, int tid) {
+    uint begin = job->idx.load();
+    while (begin < job->count) {
+        const uint left = job->count - begin;
+        const uint size = min(left, max(job->grain, left / (2 * job->entries)));
+        if (job->idx.compare_exchange_weak(begin, begin + size)) {
+            pf_run_range(job, begin, begin + size, tid);
+            begin = job->idx.load();
         }
     }
 }
 
-void pfor_run(ForTask * task, void * context, uint count, uint step/*= 1*/) {
+static inline uint64_t pf_pack_part(uint begin, uint end) {
+    return uint64_t(begin) | (uint64_t(end) << 32);
+}
+
+static void pf_contiguous(ForJob * job, int tid) {
+    const uint own = job->next_part.fetch_add(1);
+    IC_ASSERT(own < job->entries);
+    std::atomic<uint64_t> & own_part = job->parts[own];
+
+    while (true) {
+        // go through own part from the front
+        uint64_t part = own_part.load();
+        while (uint(part) < uint(part >> 32)) {
+            const uint begin = uint(part), end = uint(part >> 32);
+            const uint size = job->step ? min(end - begin, job->step) : min(end - begin, max(job->grain, (end - begin) / 4));
+            if (own_part.compare_exchange_weak(part, pf_pack_part(begin + size, end))) {
+                pf_run_range(job, begin, begin + size, tid);
+                part = own_part.load();
+            }
+        }
+
+        // take the back half of what is left in some other part, and make it the own part
+        bool stolen = false;
+        for (uint i = 1; i < job->entries && !stolen; i++) {
+            std::atomic<uint64_t> & other = job->parts[(own + i) % job->entries];
+            uint64_t other_part = other.load();
+            while (uint(other_part) < uint(other_part >> 32)) {
+                const uint begin = uint(other_part), end = uint(other_part >> 32);
+                const uint size = max(min(end - begin, job->grain), (end - begin) / 2);
+                if (other.compare_exchange_weak(other_part, pf_pack_part(begin, end - size))) {
+                    // own part is empty, so nobody else modifies it
+                    own_part.store(pf_pack_part(end - size, end));
+                    stolen = true;
+                    break;
+                }
+            }
+        }
+        if (!stolen) {
+            break;
+        }
+    }
+}
 
-    pf.func = task;
-    pf.ctx = context;
+static void pf_func(QueuedTask * task, int tid) {
+    ForJob * job = (ForJob *)task;
+    if (job->schedule == ScheduleContiguous) {
+        pf_contiguous(job, tid);
+    }
+    else if (job->step == 0) {
+        pf_guided(job, tid);
+    }
+    else {
+        pf_dynamic(job, tid);
+    }
+#if IC_POOL_STATS
+    uint64_t not_done = 0;
+    job->first_done_ns.compare_exchange_strong(not_done, time_ns());
+#endif
+    // job can go away as soon as refs gets to zero
+    if (job->refs.fetch_sub(1) == 1) {
+        notify_waiters();
+    }
+}
 
-    // Init for loop state.
-    pf.count = count;
-    pf.step = step;
-    pf.idx = 0;
+void pfor_run(ForTask * task, void * context, uint count, uint step/*= 1*/, Schedule schedule/*= ScheduleDynamic*/) {
 
-    // Start pool threads.
-    thread_pool_run(pf_func, NULL);
+    if (count == 0) {
+        return;
+    }
+    if (pool.worker_count == 0) {
+        // not initialized: just run everything here
+        for (uint i = 0; i < count; i++) {
+            task(context, i, 0);
+        }
+        return;
+    }
+
+    const bool acquired = acquire_calling_slot();
+#if IC_POOL_STATS
+    const uint64_t start = time_ns();
+#endif
+    // automatic grain: aim for at least 8 ranges per thread at the end of the loop
+    const uint grain = step ? step : max(1u, count / (uint(pool.worker_count) * 8));
+    const uint ranges = (count - 1) / grain + 1;
+    const uint entries = min(ranges, uint(pool.worker_count));
+
+    ForJob job;
+    job.execute = pf_func;
+    job.func = task;
+    job.ctx = context;
+    job.count = count;
+    job.step = step;
+    job.grain = grain;
+    job.entries = entries;
+    job.schedule = schedule;
+    job.idx.store(0);
+    job.refs.store(int(entries));
+    job.first_done_ns.store(0);
+    if (schedule == ScheduleContiguous) {
+        job.next_part.store(0);
+        for (uint i = 0; i < entries; i++) {
+            const uint begin = uint(uint64_t(count) * i / entries);
+            const uint end = uint(uint64_t(count) * (i + 1) / entries);
+            job.parts[i].store(pf_pack_part(begin, end));
+        }
+    }
+
+    // this thread runs one of the entries right away if it can
+    push_tasks(&job, s_slot >= 0 ? entries - 1 : entries);
+    if (s_slot >= 0) {
+        run_task(&job, s_slot);
+    }
+    wait_until_zero(job.refs);
+#if IC_POOL_STATS
+    const uint64_t end = time_ns();
+    pool.for_count.fetch_add(1, std::memory_order_relaxed);
+    pool.for_ns.fetch_add(end - start, std::memory_order_relaxed);
+    pool.for_tail_ns.fetch_add(end - job.first_done_ns.load(), std::memory_order_relaxed);
+#endif
+
+    IC_ASSERT(schedule == ScheduleContiguous || job.idx.load() >= job.count);
+    if (acquired) {
+        release_calling_slot();
+    }
+}
+
+
+////////////////////////////////////////////////////////
+// Task Group
+
+struct GroupTask : QueuedTask {
+    Task * func;
+    void * ctx;
+    TaskGroup * group;
+};
+
+static void group_task_func(QueuedTask * task, int tid) {
+    GroupTask * gt = (GroupTask *)task;
+    TaskGroup * group = gt->group;
+    gt->func(gt->ctx, tid);
+    delete gt;
+    if (group->pending.fetch_sub(1) == 1) {
+        notify_waiters();
+    }
+}
+
+void TaskGroup::run(Task * task, void * context) {
+    if (pool.worker_count == 0) {
+        task(context, 0);
+        return;
+    }
+    GroupTask * gt = new GroupTask;
+    gt->execute = group_task_func;
+    gt->func = task;
+    gt->ctx = context;
+    gt->group = this;
+    pending.fetch_add(1);
+    push_tasks(gt, 1);
+}
 
-    IC_ASSERT(pf.idx >= pf.count);
+void TaskGroup::wait() {
+    wait_until_zero(pending);
 }
 
 } // ic
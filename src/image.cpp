@@ -1,29 +1,277 @@
 #include "image.h"
+#include "ic_pfor.h"
+#include "simd.h"
+#include "trace.h"
 
-void SanitizePixelValues(Image& image)
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+
+ImageView::ImageView(const Image& image)
+    : width(image.width), height(image.height)
+{
+    const size_t pixel_stride = image.width * image.height == 0 ? 0 : image.pixels_size / image.width / image.height;
+    channels.reserve(image.channels.size());
+    for (const Image::Channel& ch : image.channels)
+        channels.push_back({ch.name, ch.fp16, image.pixels.get() + ch.offset, pixel_stride, pixel_stride * image.width});
+}
+
+size_t ImageView::GetInterleavedStride(char*& r_data) const
+{
+    if (channels.empty())
+        return 0;
+    const size_t stride = channels[0].x_stride;
+    char* data = channels[0].base;
+    for (const Channel& ch : channels)
+    {
+        if (ch.x_stride != stride || ch.y_stride != stride * width)
+            return 0;
+        data = std::min(data, ch.base);
+    }
+    for (const Channel& ch : channels)
+    {
+        if (size_t(ch.base - data) + (ch.fp16 ? 2 : 4) > stride)
+            return 0;
+    }
+    r_data = data;
+    return stride;
+}
+
+bool CopyImageView(const ImageView& src, const ImageView& dst)
+{
+    if (src.width != dst.width || src.height != dst.height)
+    {
+        printf("ERROR: image view sizes do not match: %zix%zi vs %zix%zi\n", src.width, src.height, dst.width, dst.height);
+        return false;
+    }
+    std::vector<const ImageView::Channel*> src_channels;
+    for (const ImageView::Channel& ch : dst.channels)
+    {
+        auto it = std::find_if(src.channels.begin(), src.channels.end(), [&](const ImageView::Channel& sch) { return sch.name == ch.name; });
+        if (it == src.channels.end() || it->fp16 != ch.fp16)
+        {
+            printf("ERROR: image does not have %s channel '%s'\n", ch.fp16 ? "fp16" : "fp32", ch.name.c_str());
+            return false;
+        }
+        src_channels.push_back(&*it);
+    }
+    ic::pfor(unsigned(dst.height), 0, [&](int y, int /*thread_idx*/) {
+        for (size_t ci = 0; ci < dst.channels.size(); ++ci)
+        {
+            const ImageView::Channel& dch = dst.channels[ci];
+            const ImageView::Channel& sch = *src_channels[ci];
+            const size_t size = dch.fp16 ? 2 : 4;
+            char* dptr = dch.at(0, y);
+            const char* sptr = sch.at(0, y);
+            if (dch.x_stride == size && sch.x_stride == size)
+            {
+                memcpy(dptr, sptr, dst.width * size);
+                continue;
+            }
+            for (size_t x = 0; x < dst.width; ++x)
+            {
+                memcpy(dptr, sptr, size);
+                dptr += dch.x_stride;
+                sptr += sch.x_stride;
+            }
+        }
+        });
+    return true;
+}
+
+static size_t CountBits(uint32_t bits)
+{
+    size_t count = 0;
+    for (; bits != 0; bits &= bits - 1)
+        ++count;
+    return count;
+}
+
+// Sets fp16 subnormals to zero, in uint16 lanes that have 0xFFFF in the masks (masks repeat
+// every period lanes; period is a multiple of 16). Returns the number of changed values.
+static size_t FlushSubnormalsFp16(uint16_t* ptr, size_t n, const uint16_t* masks, size_t period)
+{
+    size_t changed = 0;
+    size_t i = 0, m = 0;
+#if SIMD_AVX2
+    {
+        const __m256i exp_bits = _mm256_set1_epi16(0x7C00);
+        const __m256i mant_bits = _mm256_set1_epi16(0x03FF);
+        const __m256i zero = _mm256_setzero_si256();
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(ptr + i));
+            __m256i mask = _mm256_loadu_si256((const __m256i*)(masks + m));
+            __m256i exp_zero = _mm256_cmpeq_epi16(_mm256_and_si256(v, exp_bits), zero);
+            __m256i mant_zero = _mm256_cmpeq_epi16(_mm256_and_si256(v, mant_bits), zero);
+            __m256i subnormal = _mm256_and_si256(_mm256_andnot_si256(mant_zero, exp_zero), mask);
+            uint32_t bits = uint32_t(_mm256_movemask_epi8(subnormal));
+            if (bits != 0)
+            {
+                _mm256_storeu_si256((__m256i*)(ptr + i), _mm256_andnot_si256(subnormal, v));
+                changed += CountBits(bits) / 2; // two mask bits per lane
+            }
+            m += 16;
+            if (m == period)
+                m = 0;
+        }
+    }
+#endif
+#if SIMD_SSE2
+    const __m128i exp_bits = _mm_set1_epi16(0x7C00);
+    const __m128i mant_bits = _mm_set1_epi16(0x03FF);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(ptr + i));
+        __m128i mask = _mm_loadu_si128((const __m128i*)(masks + m));
+        __m128i exp_zero = _mm_cmpeq_epi16(_mm_and_si128(v, exp_bits), zero);
+        __m128i mant_zero = _mm_cmpeq_epi16(_mm_and_si128(v, mant_bits), zero);
+        __m128i subnormal = _mm_and_si128(_mm_andnot_si128(mant_zero, exp_zero), mask);
+        // subnormals are rare; only write when there are any
+        uint32_t bits = uint32_t(_mm_movemask_epi8(subnormal));
+        if (bits != 0)
+        {
+            _mm_storeu_si128((__m128i*)(ptr + i), _mm_andnot_si128(subnormal, v));
+            changed += CountBits(bits) / 2; // two mask bits per lane
+        }
+        m += 8;
+        if (m == period)
+            m = 0;
+    }
+#elif SIMD_NEON
+    const uint16x8_t exp_bits = vdupq_n_u16(0x7C00);
+    const uint16x8_t mant_bits = vdupq_n_u16(0x03FF);
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(ptr + i);
+        uint16x8_t mask = vld1q_u16(masks + m);
+        uint16x8_t exp_zero = vceqq_u16(vandq_u16(v, exp_bits), vdupq_n_u16(0));
+        uint16x8_t mant_nonzero = vtstq_u16(v, mant_bits);
+        uint16x8_t subnormal = vandq_u16(vandq_u16(exp_zero, mant_nonzero), mask);
+        // subnormals are rare; only write when there are any
+        uint64x2_t any = vreinterpretq_u64_u16(subnormal);
+        if ((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) != 0)
+        {
+            vst1q_u16(ptr + i, vbicq_u16(v, subnormal));
+            // each subnormal lane is 0xFFFF, so lane sum / 0xFFFF is their count
+            uint32x4_t sum = vpaddlq_u16(subnormal);
+            changed += (vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) + vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3)) / 0xFFFF;
+        }
+        m += 8;
+        if (m == period)
+            m = 0;
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        const uint16_t v = ptr[i];
+        if (masks[m] != 0 && (v & 0x7C00) == 0 && (v & 0x03FF) != 0)
+        {
+            ptr[i] = 0;
+            ++changed;
+        }
+        if (++m == period)
+            m = 0;
+    }
+    return changed;
+}
+
+size_t SanitizePixelValues(Image& image)
 {
+    TRACE_SCOPE("SanitizePixelValues");
     const size_t pixel_stride = image.pixels_size / image.width / image.height;
-    const char* ptr = image.pixels.get();
-    for (size_t i = 0, n = image.width * image.height; i != n; ++i)
+
+    // masks of fp16 channel lanes for 16 pixels, so that SIMD code can use whole registers
+    const size_t lanes = pixel_stride / 2;
+    std::vector<uint16_t> masks(lanes * 16, 0);
+    bool any_fp16 = false;
+    for (const Image::Channel& ch : image.channels)
     {
-        for (const Image::Channel& ch : image.channels)
+        if (!ch.fp16)
+            continue;
+        any_fp16 = true;
+        for (size_t pix = 0; pix < 16; ++pix)
+            masks[pix * lanes + ch.offset / 2] = 0xFFFF;
+    }
+    if (!any_fp16)
+        return 0;
+
+    // pixel ranges are multiples of 16 pixels, so each starts at the beginning of the masks
+    const size_t pixel_count = image.width * image.height;
+    const size_t block_pixels = 64 * 1024;
+    const size_t block_count = (pixel_count + block_pixels - 1) / block_pixels;
+    std::atomic<size_t> changed(0);
+    ic::pfor(unsigned(block_count), 1, [&](int block, int /*thread_idx*/) {
+        const size_t start = block * block_pixels;
+        const size_t count = std::min(block_pixels, pixel_count - start);
+        uint16_t* ptr = (uint16_t*)(image.pixels.get() + start * pixel_stride);
+        const size_t block_changed = FlushSubnormalsFp16(ptr, count * lanes, masks.data(), masks.size());
+        if (block_changed != 0)
+            changed += block_changed;
+        });
+    return changed;
+}
+
+// Compares values of pixels [start, start+count) bitwise (so that e.g. NaN payloads and
+// signed zeroes have to match too), prints up to print_count differences and decreases it.
+// Returns the number of values that differ.
+static size_t ComparePixels(const Image& ia, const Image& ib, const std::vector<size_t>& ch_atob, size_t start, size_t count, int& print_count)
+{
+    const size_t pixel_stride = ia.pixels_size / ia.width / ia.height;
+    const char* ptra = ia.pixels.get() + start * pixel_stride;
+    const char* ptrb = ib.pixels.get() + start * pixel_stride;
+    size_t error_count = 0;
+    for (size_t i = start, n = start + count; i != n; ++i)
+    {
+        for (size_t cidxa = 0; cidxa < ia.channels.size(); ++cidxa)
         {
-            if (ch.fp16)
+            const Image::Channel& cha = ia.channels[cidxa];
+            const Image::Channel& chb = ib.channels[ch_atob[cidxa]];
+            // channels are not necessarily aligned, e.g. fp32 after an odd number of fp16 ones
+            if (cha.fp16)
+            {
+                uint16_t va, vb;
+                memcpy(&va, ptra + cha.offset, 2);
+                memcpy(&vb, ptrb + chb.offset, 2);
+                if (va != vb)
+                {
+                    ++error_count;
+                    if (print_count > 0)
+                    {
+                        --print_count;
+                        printf("  - ch %s mismatch: pixel %zi,%zi fp16 exp %i got %i\n", cha.name.c_str(), i % ia.width, i / ia.width, va, vb);
+                    }
+                }
+            }
+            else
             {
-                uint16_t* pix = (uint16_t*)(ptr + ch.offset);
-                uint16_t val = *pix;
-                if (val < 1024 || (val >= 32769 && val <= 33791)) // subnormal
+                uint32_t va, vb;
+                memcpy(&va, ptra + cha.offset, 4);
+                memcpy(&vb, ptrb + chb.offset, 4);
+                if (va != vb)
                 {
-                    *pix = 0;
+                    ++error_count;
+                    if (print_count > 0)
+                    {
+                        --print_count;
+                        float fa, fb;
+                        memcpy(&fa, &va, 4);
+                        memcpy(&fb, &vb, 4);
+                        printf("  - ch %s mismatch: pixel %zi,%zi fp32 exp %f (%08x) got %f (%08x)\n", cha.name.c_str(), i % ia.width, i / ia.width, fa, va, fb, vb);
+                    }
                 }
             }
         }
-        ptr += pixel_stride;
+        ptra += pixel_stride;
+        ptrb += pixel_stride;
     }
+    return error_count;
 }
 
 bool CompareImages(const Image& ia, const Image& ib)
 {
+    TRACE_SCOPE("CompareImages");
     // basic info
     if (ia.width != ib.width || ia.height != ib.height || ia.channels.size() != ib.channels.size())
     {
@@ -64,42 +312,34 @@ bool CompareImages(const Image& ia, const Image& ib)
         }
     }
 
-    // compare pixel values
+    // compare pixel values, in parallel over blocks of pixels
     const size_t pixel_stride = ia.pixels_size / ia.width / ia.height;
-    const char* ptra = ia.pixels.get();
-    const char* ptrb = ib.pixels.get();
-    int error_count = 0;
-    for (size_t i = 0, n = ia.width * ia.height; i != n; ++i)
+    const size_t pixel_count = ia.width * ia.height;
+    bool same_layout = true;
+    for (size_t cidxa = 0; cidxa < ia.channels.size(); ++cidxa)
+        same_layout &= ch_atob[cidxa] == cidxa && ia.channels[cidxa].offset == ib.channels[cidxa].offset;
+
+    const size_t block_pixels = 64 * 1024;
+    const size_t block_count = (pixel_count + block_pixels - 1) / block_pixels;
+    std::vector<size_t> block_errors(block_count, 0);
+    ic::pfor(unsigned(block_count), 1, [&](int block, int /*thread_idx*/) {
+        const size_t start = block * block_pixels;
+        const size_t count = std::min(block_pixels, pixel_count - start);
+        // with the same layout, only look at individual values if there is a difference
+        if (same_layout && memcmp(ia.pixels.get() + start * pixel_stride, ib.pixels.get() + start * pixel_stride, count * pixel_stride) == 0)
+            return;
+        int print_count = 0;
+        block_errors[block] = ComparePixels(ia, ib, ch_atob, start, count, print_count);
+        });
+
+    // print the first few differences in pixel order
+    size_t error_count = 0;
+    int print_count = 10;
+    for (size_t block = 0; block < block_count; ++block)
     {
-        for (size_t cidxa = 0; cidxa < ia.channels.size(); ++cidxa)
-        {
-            const Image::Channel& cha = ia.channels[cidxa];
-            const Image::Channel& chb = ib.channels[ch_atob[cidxa]];
-            if (cha.fp16)
-            {
-                const uint16_t va = *(const uint16_t*)(ptra + cha.offset);
-                const uint16_t vb = *(const uint16_t*)(ptrb + chb.offset);
-                if (va != vb)
-                {
-                    ++error_count;
-                    if (error_count < 10)
-                        printf("  - ch %s mismatch: pixel %zi,%zi fp16 exp %i got %i\n", cha.name.c_str(), i % ia.width, i % ia.width, va, vb);
-                }
-            }
-            else
-            {
-                const float va = *(const float*)(ptra + cha.offset);
-                const float vb = *(const float*)(ptrb + chb.offset);
-                if (va != vb)
-                {
-                    ++error_count;
-                    if (error_count < 10)
-                        printf("  - ch %s mismatch: pixel %zi,%zi fp32 exp %f got %f\n", cha.name.c_str(), i % ia.width, i % ia.width, va, vb);
-                }
-            }
-        }
-        ptra += pixel_stride;
-        ptrb += pixel_stride;
+        if (block_errors[block] != 0 && print_count > 0)
+            ComparePixels(ia, ib, ch_atob, block * block_pixels, std::min(block_pixels, pixel_count - block * block_pixels), print_count);
+        error_count += block_errors[block];
     }
 
     return error_count == 0;
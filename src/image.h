@@ -4,6 +4,7 @@
 #include <vector>
 #include <stdint.h>
 #include <string>
+#include "pixelalloc.h"
 
 enum class CompressorType
 {
@@ -27,9 +28,40 @@ struct Image
     };
     size_t width = 0, height = 0;
     std::vector<Channel> channels;
-    std::unique_ptr<char[]> pixels;
+    PixelBuffer pixels;
     size_t pixels_size = 0;
 };
 
-void SanitizePixelValues(Image& image);
+// Non-owning view of image pixels: each channel has its own base pointer and x / y
+// strides in bytes (similar to Imf::Slice), so it can describe interleaved, planar or
+// mixed layouts. A view made from a const Image must only be read from.
+struct ImageView
+{
+    struct Channel {
+        std::string name;
+        bool fp16;
+        char* base; // pixel at (0, 0)
+        size_t x_stride;
+        size_t y_stride;
+        char* at(size_t x, size_t y) const { return base + x * x_stride + y * y_stride; }
+    };
+    size_t width = 0, height = 0;
+    std::vector<Channel> channels;
+
+    ImageView() = default;
+    // all channels of an interleaved image
+    ImageView(const Image& image);
+
+    // If all channels are interleaved into one buffer with rows right after each other
+    // (like in an Image), returns the pixel stride and the lowest channel base in r_data;
+    // returns 0 otherwise.
+    size_t GetInterleavedStride(char*& r_data) const;
+};
+
+// Copies pixels of dst channels from src channels with the same names; fails
+// if a channel is missing or has a different type, or if sizes do not match.
+bool CopyImageView(const ImageView& src, const ImageView& dst);
+
+// Sets fp16 subnormal values to zero; returns how many values were changed.
+size_t SanitizePixelValues(Image& image);
 bool CompareImages(const Image& ia, const Image& ib);
@@ -3,26 +3,104 @@
 #include <ImfInputFile.h>
 #include <ImfOutputFile.h>
 #include <ImfFrameBuffer.h>
+#include <IlmThreadPool.h>
 
 #include "image_exr.h"
 #include "fileio.h"
+#include "threading.h"
+#include "ic_pfor.h"
+#include "trace.h"
 
-void InitExr(int thread_count)
+#include <algorithm>
+#include <deque>
+#include <mutex>
+
+// OpenEXR thread pool provider that runs tasks on the shared thread pool.
+// numThreads is the pool thread count (zero if there are no other threads), the same
+// for every caller. OpenEXR waits for its task groups by blocking, without running
+// other tasks, so:
+// - tasks added from a pool thread are run right in addTask; queueing them would park
+//   the pool thread outside the scheduler, and could deadlock once all of them wait.
+// - other threads (e.g. main) queue tasks, and help while adding them: once every
+//   worker has a task waiting, the calling thread runs the oldest queued one itself,
+//   instead of leaving its CPU idle while it later blocks in OpenEXR.
+class ExrPoolProvider : public ILMTHREAD_NAMESPACE::ThreadPoolProvider
+{
+public:
+    int numThreads() const override { return GetThreadCount() <= 1 ? 0 : GetThreadCount(); }
+    void setNumThreads(int /*count*/) override {} // thread count is set up by InitThreading
+    void addTask(ILMTHREAD_NAMESPACE::Task* task) override
+    {
+        if (GetThreadCount() <= 1 || ic::current_thread_index() >= 0)
+        {
+            task->execute();
+            delete task;
+            return;
+        }
+        size_t queued = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_back(task);
+            queued = m_queue.size();
+        }
+        m_tasks.run([](void* context, int /*thread_idx*/) {
+            ((ExrPoolProvider*)context)->RunQueuedTask();
+            }, this);
+        if (queued >= size_t(GetThreadCount() - 1))
+            RunQueuedTask();
+    }
+    void finish() override { m_tasks.wait(); }
+private:
+    // Runs the oldest queued task, if any is left; each queued task has a pool
+    // task for it, but the calling thread may have run it already.
+    void RunQueuedTask()
+    {
+        ILMTHREAD_NAMESPACE::Task* task = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_queue.empty())
+                return;
+            task = m_queue.front();
+            m_queue.pop_front();
+        }
+        task->execute();
+        delete task;
+    }
+
+    std::mutex m_mutex;
+    std::deque<ILMTHREAD_NAMESPACE::Task*> m_queue;
+    ic::TaskGroup m_tasks;
+};
+
+void InitExr()
 {
-    Imf::setGlobalThreadCount(thread_count);
+    // the global pool takes ownership of the provider
+    ILMTHREAD_NAMESPACE::ThreadPool::globalThreadPool().setThreadProvider(new ExrPoolProvider());
 }
 
-bool LoadExrFile(MyIStream &mem, Image& r_image)
+bool LoadExrFile(MyIStream &mem, Image& r_image, const std::vector<std::string>& load_channels)
 {
+    TRACE_SCOPE("LoadExrFile");
     Imf::InputFile file(mem);
     const Imf::Header& header = file.header();
     const Imf::ChannelList& channels = header.channels();
     Imath::Box2i dw = header.dataWindow();
     r_image.width  = dw.max.x - dw.min.x + 1;
     r_image.height = dw.max.y - dw.min.y + 1;
+
+    for (const std::string& name : load_channels) {
+        if (channels.findChannel(name) == nullptr)
+        {
+            printf("EXR file does not have channel %s\n", name.c_str());
+            return false;
+        }
+    }
     
+    // channels that are not in the frame buffer are not decoded
     size_t offset = 0;
     for (auto it = channels.begin(); it != channels.end(); ++it) {
+        if (!load_channels.empty() && std::find(load_channels.begin(), load_channels.end(), it.name()) == load_channels.end())
+            continue;
         const Imf::PixelType type = it.channel().type;
         if (type == Imf::UINT)
         {
@@ -35,7 +113,7 @@ bool LoadExrFile(MyIStream &mem, Image& r_image)
     }
     
     r_image.pixels_size = r_image.width * r_image.height * offset;
-    r_image.pixels = std::unique_ptr<char[]>(new char[r_image.pixels_size]);
+    r_image.pixels = MakePixelBuffer(r_image.pixels_size);
     
     Imf::FrameBuffer fb;
     for (const auto& ch : r_image.channels) {
@@ -48,8 +126,41 @@ bool LoadExrFile(MyIStream &mem, Image& r_image)
     return true;
 }
 
-bool SaveExrFile(MyOStream &mem, const Image& image, CompressorType cmp_type, int cmp_level)
+bool LoadExrFile(MyIStream& mem, const ImageView& dst)
+{
+    TRACE_SCOPE("LoadExrFile");
+    Imf::InputFile file(mem);
+    const Imf::Header& header = file.header();
+    const Imf::ChannelList& channels = header.channels();
+    Imath::Box2i dw = header.dataWindow();
+    const size_t width = dw.max.x - dw.min.x + 1;
+    const size_t height = dw.max.y - dw.min.y + 1;
+    if (width != dst.width || height != dst.height)
+    {
+        printf("EXR file size %zix%zi does not match destination %zix%zi\n", width, height, dst.width, dst.height);
+        return false;
+    }
+
+    Imf::FrameBuffer fb;
+    for (const ImageView::Channel& ch : dst.channels) {
+        const Imf::Channel* fch = channels.findChannel(ch.name);
+        if (fch == nullptr || fch->type != (ch.fp16 ? Imf::HALF : Imf::FLOAT))
+        {
+            printf("EXR file does not have %s channel %s\n", ch.fp16 ? "HALF" : "FLOAT", ch.name.c_str());
+            return false;
+        }
+        char* ptr = ch.base - dw.min.x * ch.x_stride - dw.min.y * ch.y_stride;
+        fb.insert(ch.name, Imf::Slice(fch->type, ptr, ch.x_stride, ch.y_stride));
+    }
+
+    file.setFrameBuffer(fb);
+    file.readPixels(dw.min.y, dw.max.y);
+    return true;
+}
+
+bool SaveExrFile(MyOStream &mem, const ImageView& image, CompressorType cmp_type, int cmp_level)
 {
+    TRACE_SCOPE("SaveExrFile");
     Imf::Compression compression = Imf::NUM_COMPRESSION_METHODS;
     switch (cmp_type) {
         case CompressorType::ExrNone: compression = Imf::NO_COMPRESSION; break;
@@ -70,12 +181,10 @@ bool SaveExrFile(MyOStream &mem, const Image& image, CompressorType cmp_type, in
             header.zipCompressionLevel() = cmp_level;
     }
     
-    const size_t stride = image.pixels_size / image.width / image.height;
-    for (const Image::Channel& ch : image.channels)
+    for (const ImageView::Channel& ch : image.channels)
     {
         header.channels().insert(ch.name, Imf::Channel(ch.fp16 ? Imf::HALF : Imf::FLOAT));
-        const char *ptr = image.pixels.get() + ch.offset;
-        fb.insert(ch.name, Imf::Slice(ch.fp16 ? Imf::HALF : Imf::FLOAT, (char*)ptr, stride, stride * image.width));
+        fb.insert(ch.name, Imf::Slice(ch.fp16 ? Imf::HALF : Imf::FLOAT, ch.base, ch.x_stride, ch.y_stride));
     }
 
     Imf::OutputFile file(mem, header);
@@ -83,3 +192,13 @@ bool SaveExrFile(MyOStream &mem, const Image& image, CompressorType cmp_type, in
     file.writePixels(int(image.height));
     return true;
 }
+
+std::future<bool> SaveExrFileAsync(MyOStream& mem, const Image& image, CompressorType cmp_type, int cmp_level)
+{
+    return RunAsync([&mem, &image, cmp_type, cmp_level]() { return SaveExrFile(mem, image, cmp_type, cmp_level); });
+}
+
+std::future<bool> LoadExrFileAsync(MyIStream& mem, Image& r_image, const std::vector<std::string>& channels)
+{
+    return RunAsync([&mem, &r_image, channels]() { return LoadExrFile(mem, r_image, channels); });
+}
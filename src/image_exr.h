@@ -2,7 +2,16 @@
 
 #include "image.h"
 #include "fileio.h"
+#include <future>
 
-void InitExr(int thread_count);
-bool SaveExrFile(MyOStream& mem, const Image& image, CompressorType cmp_type, int cmp_level);
-bool LoadExrFile(MyIStream& mem, Image& r_image);
+void InitExr();
+bool SaveExrFile(MyOStream& mem, const ImageView& image, CompressorType cmp_type, int cmp_level);
+// Loads only the given channels (in file order) if the list is not empty.
+bool LoadExrFile(MyIStream& mem, Image& r_image, const std::vector<std::string>& channels = {});
+// Loads the view's channels directly into its memory; file size and channel types must match.
+bool LoadExrFile(MyIStream& mem, const ImageView& dst);
+
+// Same as above, but run on the shared thread pool; arguments have to stay alive until the future is ready.
+// Note that OpenEXR work started from a pool thread is not split into further tasks.
+std::future<bool> SaveExrFileAsync(MyOStream& mem, const Image& image, CompressorType cmp_type, int cmp_level);
+std::future<bool> LoadExrFileAsync(MyIStream& mem, Image& r_image, const std::vector<std::string>& channels = {});
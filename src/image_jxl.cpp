@@ -1,28 +1,449 @@
 #include <jxl/decode_cxx.h>
 #include <jxl/encode_cxx.h>
 #include <jxl/color_encoding.h>
-#include <jxl/thread_parallel_runner_cxx.h>
+#include <jxl/parallel_runner.h>
 
 #include "image_jxl.h"
+#include "threading.h"
+#include "ic_pfor.h"
+#include "trace.h"
+#include "simd.h"
 
 #include <string.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
 
-static JxlThreadParallelRunnerPtr s_jxl_runner;
+// Number of libjxl runner jobs the current thread is in the middle of.
+static thread_local int s_jxl_job_depth = 0;
 
-void InitJxl(int thread_count)
+// libjxl parallel runner on top of the shared thread pool
+static JxlParallelRetCode JxlPoolRunner(void* /*runner_opaque*/, void* jpegxl_opaque, JxlParallelRunInit init, JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range)
+{
+    const JxlParallelRetCode res = init(jpegxl_opaque, GetThreadCount());
+    if (res != JXL_PARALLEL_RET_SUCCESS)
+        return res;
+    TRACE_SCOPE("JxlParallelRun");
+    ic::pfor(end_range - start_range, 0, [&](int idx, int thread_idx) {
+        ++s_jxl_job_depth;
+        func(jpegxl_opaque, start_range + idx, thread_idx);
+        --s_jxl_job_depth;
+        });
+    return JXL_PARALLEL_RET_SUCCESS;
+}
+
+void InitJxl()
+{
+}
+
+// Swizzle kernels between image pixels and the layouts libjxl uses: interleaved color
+// channels, planar extra channels. Each works on a run of pixels within one row; whole
+// images are done with rows in parallel.
+
+template<typename T>
+static inline T LoadValue(const char* ptr)
+{
+    T v;
+    memcpy(&v, ptr, sizeof(T));
+    return v;
+}
+
+// Copies count elements of Size bytes between strided buffers
+template<size_t Size>
+static void CopyStrided(char* dst, size_t dst_stride, const char* src, size_t src_stride, size_t count)
+{
+    for (size_t i = 0; i != count; ++i)
+    {
+        memcpy(dst, src, Size);
+        dst += dst_stride;
+        src += src_stride;
+    }
+}
+
+typedef void CopyStridedFunc(char* dst, size_t dst_stride, const char* src, size_t src_stride, size_t count);
+static CopyStridedFunc* GetCopyStridedFunc(size_t size)
+{
+    switch (size)
+    {
+    case 2: return CopyStrided<2>;
+    case 4: return CopyStrided<4>;
+    case 6: return CopyStrided<6>;
+    case 8: return CopyStrided<8>;
+    case 12: return CopyStrided<12>;
+    case 16: return CopyStrided<16>;
+    default: return nullptr;
+    }
+}
+
+#if SIMD_SSE2 || SIMD_NEON
+// Interleaves N planar channels; returns how many pixels were done
+template<typename T, int N>
+static size_t InterleavePlanar(T* dst, const T* const* src, size_t count)
+{
+    size_t i = 0;
+#if SIMD_SSE2
+    if (N == 4 && sizeof(T) == 2)
+    {
+        for (; i + 8 <= count; i += 8)
+        {
+            const __m128i r = _mm_loadu_si128((const __m128i*)(src[0] + i));
+            const __m128i g = _mm_loadu_si128((const __m128i*)(src[1] + i));
+            const __m128i b = _mm_loadu_si128((const __m128i*)(src[2] + i));
+            const __m128i a = _mm_loadu_si128((const __m128i*)(src[3] + i));
+            const __m128i rg_lo = _mm_unpacklo_epi16(r, g), rg_hi = _mm_unpackhi_epi16(r, g);
+            const __m128i ba_lo = _mm_unpacklo_epi16(b, a), ba_hi = _mm_unpackhi_epi16(b, a);
+            __m128i* d = (__m128i*)(dst + i * 4);
+            _mm_storeu_si128(d + 0, _mm_unpacklo_epi32(rg_lo, ba_lo));
+            _mm_storeu_si128(d + 1, _mm_unpackhi_epi32(rg_lo, ba_lo));
+            _mm_storeu_si128(d + 2, _mm_unpacklo_epi32(rg_hi, ba_hi));
+            _mm_storeu_si128(d + 3, _mm_unpackhi_epi32(rg_hi, ba_hi));
+        }
+    }
+    if (N == 4 && sizeof(T) == 4)
+    {
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m128i r = _mm_loadu_si128((const __m128i*)(src[0] + i));
+            const __m128i g = _mm_loadu_si128((const __m128i*)(src[1] + i));
+            const __m128i b = _mm_loadu_si128((const __m128i*)(src[2] + i));
+            const __m128i a = _mm_loadu_si128((const __m128i*)(src[3] + i));
+            const __m128i rg_lo = _mm_unpacklo_epi32(r, g), rg_hi = _mm_unpackhi_epi32(r, g);
+            const __m128i ba_lo = _mm_unpacklo_epi32(b, a), ba_hi = _mm_unpackhi_epi32(b, a);
+            __m128i* d = (__m128i*)(dst + i * 4);
+            _mm_storeu_si128(d + 0, _mm_unpacklo_epi64(rg_lo, ba_lo));
+            _mm_storeu_si128(d + 1, _mm_unpackhi_epi64(rg_lo, ba_lo));
+            _mm_storeu_si128(d + 2, _mm_unpacklo_epi64(rg_hi, ba_hi));
+            _mm_storeu_si128(d + 3, _mm_unpackhi_epi64(rg_hi, ba_hi));
+        }
+    }
+    // N=3: each pixel is stored as four values, the last one gets overwritten by the next
+    // pixel; so there has to be one more pixel after each block
+    if (N == 3 && sizeof(T) == 2)
+    {
+        for (; i + 8 < count; i += 8)
+        {
+            const __m128i r = _mm_loadu_si128((const __m128i*)(src[0] + i));
+            const __m128i g = _mm_loadu_si128((const __m128i*)(src[1] + i));
+            const __m128i b = _mm_loadu_si128((const __m128i*)(src[2] + i));
+            const __m128i rg_lo = _mm_unpacklo_epi16(r, g), rg_hi = _mm_unpackhi_epi16(r, g);
+            const __m128i bb_lo = _mm_unpacklo_epi16(b, b), bb_hi = _mm_unpackhi_epi16(b, b);
+            const __m128i p[4] = {_mm_unpacklo_epi32(rg_lo, bb_lo), _mm_unpackhi_epi32(rg_lo, bb_lo), _mm_unpacklo_epi32(rg_hi, bb_hi), _mm_unpackhi_epi32(rg_hi, bb_hi)};
+            T* d = dst + i * 3;
+            for (int k = 0; k < 4; ++k)
+            {
+                _mm_storel_epi64((__m128i*)(d + k * 6), p[k]);
+                _mm_storel_epi64((__m128i*)(d + k * 6 + 3), _mm_unpackhi_epi64(p[k], p[k]));
+            }
+        }
+    }
+    if (N == 3 && sizeof(T) == 4)
+    {
+        for (; i + 4 < count; i += 4)
+        {
+            const __m128i r = _mm_loadu_si128((const __m128i*)(src[0] + i));
+            const __m128i g = _mm_loadu_si128((const __m128i*)(src[1] + i));
+            const __m128i b = _mm_loadu_si128((const __m128i*)(src[2] + i));
+            const __m128i rg_lo = _mm_unpacklo_epi32(r, g), rg_hi = _mm_unpackhi_epi32(r, g);
+            const __m128i bb_lo = _mm_unpacklo_epi32(b, b), bb_hi = _mm_unpackhi_epi32(b, b);
+            const __m128i p[4] = {_mm_unpacklo_epi64(rg_lo, bb_lo), _mm_unpackhi_epi64(rg_lo, bb_lo), _mm_unpacklo_epi64(rg_hi, bb_hi), _mm_unpackhi_epi64(rg_hi, bb_hi)};
+            T* d = dst + i * 3;
+            for (int k = 0; k < 4; ++k)
+                _mm_storeu_si128((__m128i*)(d + k * 3), p[k]);
+        }
+    }
+#elif SIMD_NEON
+    if (sizeof(T) == 2)
+    {
+        const uint16_t* const* s = (const uint16_t* const*)src;
+        uint16_t* d = (uint16_t*)dst;
+        for (; N >= 3 && i + 8 <= count; i += 8)
+        {
+            if (N == 4)
+            {
+                uint16x8x4_t v = {{vld1q_u16(s[0] + i), vld1q_u16(s[1] + i), vld1q_u16(s[2] + i), vld1q_u16(s[3] + i)}};
+                vst4q_u16(d + i * 4, v);
+            }
+            else
+            {
+                uint16x8x3_t v = {{vld1q_u16(s[0] + i), vld1q_u16(s[1] + i), vld1q_u16(s[2] + i)}};
+                vst3q_u16(d + i * 3, v);
+            }
+        }
+    }
+    else
+    {
+        const uint32_t* const* s = (const uint32_t* const*)src;
+        uint32_t* d = (uint32_t*)dst;
+        for (; N >= 3 && i + 4 <= count; i += 4)
+        {
+            if (N == 4)
+            {
+                uint32x4x4_t v = {{vld1q_u32(s[0] + i), vld1q_u32(s[1] + i), vld1q_u32(s[2] + i), vld1q_u32(s[3] + i)}};
+                vst4q_u32(d + i * 4, v);
+            }
+            else
+            {
+                uint32x4x3_t v = {{vld1q_u32(s[0] + i), vld1q_u32(s[1] + i), vld1q_u32(s[2] + i)}};
+                vst3q_u32(d + i * 3, v);
+            }
+        }
+    }
+#endif
+    return i;
+}
+
+// Reverses order of N (3 or 4) adjacent channels in each src_stride sized pixel (e.g. EXR
+// sorts channel names, so RGBA is stored as ABGR, and RGB as BGR); returns how many pixels
+// were done. With N=3 pixels are read and written as four values, the extra one past the
+// channels; so the last pixel is left for the caller, where that could be out of bounds.
+template<typename T, int N>
+static size_t GatherReversed(T* dst, const char* src, size_t src_stride, size_t count)
+{
+    const size_t simd_count = N == 4 ? count : count - (count != 0);
+    size_t i = 0;
+#if SIMD_SSE2
+    if (sizeof(T) == 2)
+    {
+        for (; i + 2 <= simd_count; i += 2)
+        {
+            __m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)src), _mm_loadl_epi64((const __m128i*)(src + src_stride)));
+            if (N == 4)
+            {
+                v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+                _mm_storeu_si128((__m128i*)(dst + i * 4), v);
+            }
+            else
+            {
+                v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+                _mm_storel_epi64((__m128i*)(dst + i * 3), v);
+                _mm_storel_epi64((__m128i*)(dst + i * 3 + 3), _mm_unpackhi_epi64(v, v));
+            }
+            src += src_stride * 2;
+        }
+    }
+    else
+    {
+        for (; i < simd_count; ++i)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i*)src);
+            _mm_storeu_si128((__m128i*)(dst + i * N), _mm_shuffle_epi32(v, N == 4 ? _MM_SHUFFLE(0, 1, 2, 3) : _MM_SHUFFLE(3, 0, 1, 2)));
+            src += src_stride;
+        }
+    }
+#elif SIMD_NEON
+    if (sizeof(T) == 2)
+    {
+        for (; i < simd_count; ++i)
+        {
+            const uint16x4_t v = vrev64_u16(vld1_u16((const uint16_t*)src));
+            vst1_u16((uint16_t*)(dst + i * N), N == 4 ? v : vext_u16(v, v, 1));
+            src += src_stride;
+        }
+    }
+    else
+    {
+        for (; i < simd_count; ++i)
+        {
+            const uint32x4_t v = vrev64q_u32(vld1q_u32((const uint32_t*)src));
+            vst1q_u32((uint32_t*)(dst + i * N), N == 4 ? vextq_u32(v, v, 2) : vextq_u32(v, v, 3));
+            src += src_stride;
+        }
+    }
+#endif
+    return i;
+}
+#endif // #if SIMD_SSE2 || SIMD_NEON
+
+// Gathers count pixels of N channels of type T, starting at (x, y), into interleaved dst
+template<typename T, int N>
+static void GatherPixels(void* dst_ptr, const ImageView::Channel* const* channels, size_t x, size_t y, size_t count)
+{
+    T* dst = (T*)dst_ptr;
+    const char* src[N];
+    size_t stride[N];
+    bool planar = true, reversed = N >= 3;
+    for (int c = 0; c < N; ++c)
+    {
+        src[c] = channels[c]->at(x, y);
+        stride[c] = channels[c]->x_stride;
+        planar &= stride[c] == sizeof(T);
+        reversed &= stride[c] == stride[0] && src[c] == src[0] - c * sizeof(T);
+    }
+    if (N == 1 && planar)
+    {
+        memcpy(dst, src[0], count * sizeof(T));
+        return;
+    }
+    size_t i = 0;
+#if SIMD_SSE2 || SIMD_NEON
+    if (planar)
+        i = InterleavePlanar<T, N>(dst, (const T* const*)src, count);
+    else if (reversed && stride[0] >= N * sizeof(T))
+        i = GatherReversed<T, N>(dst, src[N - 1], stride[0], count);
+#endif
+    for (; i != count; ++i)
+    {
+        for (int c = 0; c < N; ++c)
+            dst[i * N + c] = LoadValue<T>(src[c] + i * stride[c]);
+    }
+}
+
+typedef void GatherPixelsFunc(void* dst, const ImageView::Channel* const* channels, size_t x, size_t y, size_t count);
+static GatherPixelsFunc* GetGatherPixelsFunc(int channel_count, bool fp16)
+{
+    switch (channel_count)
+    {
+    case 1: return fp16 ? GatherPixels<uint16_t, 1> : GatherPixels<uint32_t, 1>;
+    case 3: return fp16 ? GatherPixels<uint16_t, 3> : GatherPixels<uint32_t, 3>;
+    case 4: return fp16 ? GatherPixels<uint16_t, 4> : GatherPixels<uint32_t, 4>;
+    default: return nullptr;
+    }
+}
+
+// Source of frame pixels for libjxl chunked encoding: rectangles of color and
+// extra channels are gathered from the image view when the encoder asks for
+// them, so there is no full image copy of the channels up front. The encoder
+// can ask from several threads at once, so each request gets its own buffer.
+struct JxlChunkedSource
+{
+    size_t width = 0, height = 0;
+    const ImageView::Channel* color[4] = {};
+    int color_count = 0;
+    bool color_fp16 = false;
+    std::vector<const ImageView::Channel*> extra; // by extra channel index
+
+    // buffers handed out that were allocated (not pointers into the image)
+    std::mutex mutex;
+    std::vector<const void*> allocated;
+
+    ~JxlChunkedSource()
+    {
+        for (const void* buf : allocated)
+            FreePixels((char*)buf);
+    }
+};
+
+static void JxlChunkedColorFormat(void* opaque, JxlPixelFormat* pixel_format)
+{
+    const JxlChunkedSource* source = (const JxlChunkedSource*)opaque;
+    *pixel_format = {uint32_t(source->color_count), source->color_fp16 ? JXL_TYPE_FLOAT16 : JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+}
+
+static void JxlChunkedExtraFormat(void* opaque, size_t ec_index, JxlPixelFormat* pixel_format)
+{
+    const JxlChunkedSource* source = (const JxlChunkedSource*)opaque;
+    *pixel_format = {1, source->extra[ec_index]->fp16 ? JXL_TYPE_FLOAT16 : JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+}
+
+// Gathers a rectangle of channels (1, 3 or 4, all of same type) into an interleaved
+// pixel buffer, rows in parallel; a single planar channel is returned in place.
+// libjxl asks for pixels from the thread that called into the encoder, but should it
+// ever ask from inside one of its runner jobs, rows are copied serially there: while
+// waiting, a nested pfor could run another job of the same encoder with the same
+// thread index, whose per-thread state is in use.
+static const void* GatherRect(JxlChunkedSource* source, const ImageView::Channel* const* channels, int channel_count, bool fp16, size_t xpos, size_t ypos, size_t xsize, size_t ysize, size_t* row_offset)
+{
+    const size_t pixel_size = channel_count * (fp16 ? 2 : 4);
+    if (channel_count == 1 && channels[0]->x_stride == pixel_size)
+    {
+        *row_offset = channels[0]->y_stride;
+        return channels[0]->at(xpos, ypos);
+    }
+    TRACE_SCOPE("JxlSwizzle");
+    GatherPixelsFunc* func = GetGatherPixelsFunc(channel_count, fp16);
+    char* buffer = AllocPixels(xsize * ysize * pixel_size);
+    const size_t row_size = xsize * pixel_size;
+    if (s_jxl_job_depth > 0)
+    {
+        for (size_t y = 0; y < ysize; ++y)
+            func(buffer + y * row_size, channels, xpos, ypos + y, xsize);
+    }
+    else
+    {
+        ic::pfor(unsigned(ysize), 0, [&](int y, int /*thread_idx*/) {
+            func(buffer + y * row_size, channels, xpos, ypos + y, xsize);
+            });
+    }
+    *row_offset = row_size;
+    std::lock_guard<std::mutex> lock(source->mutex);
+    source->allocated.push_back(buffer);
+    return buffer;
+}
+
+static const void* JxlChunkedColorData(void* opaque, size_t xpos, size_t ypos, size_t xsize, size_t ysize, size_t* row_offset)
+{
+    JxlChunkedSource* source = (JxlChunkedSource*)opaque;
+    return GatherRect(source, source->color, source->color_count, source->color_fp16, xpos, ypos, xsize, ysize, row_offset);
+}
+
+static const void* JxlChunkedExtraData(void* opaque, size_t ec_index, size_t xpos, size_t ypos, size_t xsize, size_t ysize, size_t* row_offset)
+{
+    JxlChunkedSource* source = (JxlChunkedSource*)opaque;
+    const ImageView::Channel* ch = source->extra[ec_index];
+    return GatherRect(source, &ch, 1, ch->fp16, xpos, ypos, xsize, ysize, row_offset);
+}
+
+static void JxlChunkedRelease(void* opaque, const void* buf)
+{
+    JxlChunkedSource* source = (JxlChunkedSource*)opaque;
+    {
+        std::lock_guard<std::mutex> lock(source->mutex);
+        auto it = std::find(source->allocated.begin(), source->allocated.end(), buf);
+        if (it == source->allocated.end())
+            return; // points into the image
+        *it = source->allocated.back();
+        source->allocated.pop_back();
+    }
+    FreePixels((char*)buf);
+}
+
+// Encoder output goes through a small staging buffer straight into the output stream;
+// libjxl seeks back to fill in section sizes once they are known.
+struct JxlOutputTarget
+{
+    MyOStream* mem = nullptr;
+    uint64_t base = 0; // stream position where JXL data starts
+    std::unique_ptr<char[]> buffer; // not a vector to avoid zero-filling it
+    size_t capacity = 0;
+};
+
+static void* JxlOutputGetBuffer(void* opaque, size_t* size)
+{
+    JxlOutputTarget* target = (JxlOutputTarget*)opaque;
+    if (*size > target->capacity)
+    {
+        target->buffer.reset(new char[*size]);
+        target->capacity = *size;
+    }
+    return target->buffer.get();
+}
+
+static void JxlOutputReleaseBuffer(void* opaque, size_t written_bytes)
+{
+    JxlOutputTarget* target = (JxlOutputTarget*)opaque;
+    target->mem->write(target->buffer.get(), int(written_bytes));
+}
+
+static void JxlOutputSeek(void* opaque, uint64_t position)
+{
+    JxlOutputTarget* target = (JxlOutputTarget*)opaque;
+    target->mem->seekp(target->base + position);
+}
+
+static void JxlOutputSetFinalizedPosition(void* /*opaque*/, uint64_t /*finalized_position*/)
 {
-    s_jxl_runner = JxlThreadParallelRunnerMake(nullptr, thread_count);
 }
 
 bool LoadJxlFile(MyIStream &mem, Image& r_image)
 {    
+    TRACE_SCOPE("LoadJxlFile");
     JxlDecoderPtr dec = JxlDecoderMake(nullptr);
     if (JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO | JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS)
     {
         printf("Failed to read JXL: JxlDecoderSubscribeEvents failed\n");
         return false;
     }
-    if (JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner, s_jxl_runner.get()) != JXL_DEC_SUCCESS)
+    if (JxlDecoderSetParallelRunner(dec.get(), JxlPoolRunner, nullptr) != JXL_DEC_SUCCESS)
     {
         printf("Failed to read JXL: JxlDecoderSetParallelRunner failed\n");
         return false;
@@ -37,11 +458,15 @@ bool LoadJxlFile(MyIStream &mem, Image& r_image)
     int rgba_channels = 0;
     // not a vector to avoid zero-initialization of the whole buffer
     size_t total_buffer_size = 0;
-    std::unique_ptr<uint8_t[]> planar_buffer;
+    PixelBuffer planar_buffer;
 
     while (true)
     {
-        JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+        JxlDecoderStatus status;
+        {
+            TRACE_SCOPE("JxlDecoderProcessInput");
+            status = JxlDecoderProcessInput(dec.get());
+        }
 
         if (status == JXL_DEC_ERROR)
         {
@@ -115,12 +540,12 @@ bool LoadJxlFile(MyIStream &mem, Image& r_image)
             total_buffer_size = r_image.width * r_image.height * offset;
             if (extra_non_alpha_channels == 0)
             {
-                r_image.pixels = std::unique_ptr<char[]>(new char[total_buffer_size]);
+                r_image.pixels = MakePixelBuffer(total_buffer_size);
                 r_image.pixels_size = total_buffer_size;
             }
             else
             {
-                planar_buffer = std::unique_ptr<uint8_t[]>(new uint8_t[total_buffer_size]);
+                planar_buffer = MakePixelBuffer(total_buffer_size);
             }
         }
         else if (status == JXL_DEC_FRAME)
@@ -160,7 +585,7 @@ bool LoadJxlFile(MyIStream &mem, Image& r_image)
         {
             JxlPixelFormat ch_fmt = { uint32_t(rgba_channels), r_image.channels.front().fp16 ? JXL_TYPE_FLOAT16 : JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
             size_t ch_total_size = r_image.width * r_image.height * (ch_fmt.data_type == JXL_TYPE_FLOAT16 ? 2 : 4) * ch_fmt.num_channels;
-            if (JxlDecoderSetImageOutBuffer(dec.get(), &ch_fmt, extra_non_alpha_channels == 0 ? (uint8_t*)r_image.pixels.get() : planar_buffer.get(), ch_total_size) != JXL_DEC_SUCCESS)
+            if (JxlDecoderSetImageOutBuffer(dec.get(), &ch_fmt, extra_non_alpha_channels == 0 ? r_image.pixels.get() : planar_buffer.get(), ch_total_size) != JXL_DEC_SUCCESS)
             {
                 printf("Failed to read JXL: JxlDecoderSetImageOutBuffer failed\n");
                 return false;
@@ -197,41 +622,48 @@ bool LoadJxlFile(MyIStream &mem, Image& r_image)
 
     if (extra_non_alpha_channels != 0)
     {
-        // Swizzle data into interleaved layout. Note that especially for large
-        // images, it seems to be much faster to do the loop by linearly writing
-        // into destination, with scattered reads (i.e. order is "for all pixels,
-        // for all channels") than it is to do linear reads, scattered writes
-        // ("for all channels, for all pixels").
-        r_image.pixels = std::unique_ptr<char[]>(new char[total_buffer_size]);
+        // Swizzle data into interleaved layout, rows in parallel. Within a row, the
+        // color block and then each extra channel get scattered into destination
+        // pixels; the destination row stays in cache while that happens, so it is
+        // about as fast as writing linearly with scattered reads.
+        TRACE_SCOPE("JxlSwizzle");
+        r_image.pixels = MakePixelBuffer(total_buffer_size);
         r_image.pixels_size = total_buffer_size;
-        const uint8_t* src_ptr = planar_buffer.get();
+        const char* src_ptr = planar_buffer.get();
+        const size_t width = r_image.width;
         const size_t pixel_stride = total_buffer_size / r_image.width / r_image.height;
-        char* dst_ptr = r_image.pixels.get();
-
-        const size_t color_ch_stride = rgba_channels * (r_image.channels[0].fp16 ? 2 : 4);
-        const uint8_t* src_col_ptr = src_ptr;
         const size_t pixel_count = r_image.width * r_image.height;
-        for (size_t i = 0, n = r_image.width * r_image.height; i != n; ++i)
-        {
-            // base color channels
-            memcpy(dst_ptr, src_col_ptr, color_ch_stride);
-            dst_ptr += color_ch_stride;
-            src_col_ptr += color_ch_stride;
-
-            // extra channels
+        const size_t color_ch_stride = rgba_channels * (r_image.channels[0].fp16 ? 2 : 4);
+        CopyStridedFunc* copy_color = GetCopyStridedFunc(color_ch_stride);
+        ic::pfor(unsigned(r_image.height), 0, [&](int y, int /*thread_idx*/) {
+            char* dst_row = r_image.pixels.get() + y * width * pixel_stride;
+            copy_color(dst_row, pixel_stride, src_ptr + y * width * color_ch_stride, color_ch_stride, width);
             for (size_t ich = rgba_channels, nch = r_image.channels.size(); ich != nch; ++ich)
             {
                 const size_t ch_size = r_image.channels[ich].fp16 ? 2 : 4;
                 const size_t ch_offset = r_image.channels[ich].offset;
-                memcpy(dst_ptr, src_ptr + ch_offset * pixel_count + i * ch_size, ch_size);
-                dst_ptr += ch_size;
+                const char* src_row = src_ptr + ch_offset * pixel_count + y * width * ch_size;
+                if (ch_size == 2)
+                    CopyStrided<2>(dst_row + ch_offset, pixel_stride, src_row, 2, width);
+                else
+                    CopyStrided<4>(dst_row + ch_offset, pixel_stride, src_row, 4, width);
             }
-        }
+            });
     }
     
     return true;
 }
 
+bool LoadJxlFile(MyIStream& mem, const ImageView& dst)
+{
+    // libjxl decodes into interleaved color and planar extra channel buffers of its own
+    // layout, so decode into an image and copy the view channels from it
+    Image image;
+    if (!LoadJxlFile(mem, image))
+        return false;
+    return CopyImageView(image, dst);
+}
+
 struct RGBAChannels
 {
     int r = -1;
@@ -240,7 +672,7 @@ struct RGBAChannels
     int a = -1;
 };
 
-static RGBAChannels FindImageRGBAChannels(const Image& image)
+static RGBAChannels FindImageRGBAChannels(const ImageView& image)
 {
     RGBAChannels rgba;
     for (int ch = 0; ch < image.channels.size(); ++ch)
@@ -270,15 +702,30 @@ static RGBAChannels FindImageRGBAChannels(const Image& image)
     return rgba;
 }
 
-bool SaveJxlFile(MyOStream& mem, const Image& image, int cmp_level)
+bool SaveJxlFile(MyOStream& mem, const ImageView& image, int cmp_level)
 {
+    TRACE_SCOPE("SaveJxlFile");
     // create encoder
     JxlEncoderPtr enc = JxlEncoderMake(nullptr);
-    if (JxlEncoderSetParallelRunner(enc.get(), JxlThreadParallelRunner, s_jxl_runner.get()) != JXL_ENC_SUCCESS)
+    if (JxlEncoderSetParallelRunner(enc.get(), JxlPoolRunner, nullptr) != JXL_ENC_SUCCESS)
     {
         printf("Failed to write JXL: JxlEncoderSetParallelRunner failed\n");
         return false;
     }
+    JxlOutputTarget target;
+    target.mem = &mem;
+    target.base = mem.tellp();
+    JxlEncoderOutputProcessor output = {};
+    output.opaque = &target;
+    output.get_buffer = JxlOutputGetBuffer;
+    output.release_buffer = JxlOutputReleaseBuffer;
+    output.seek = JxlOutputSeek;
+    output.set_finalized_position = JxlOutputSetFinalizedPosition;
+    if (JxlEncoderSetOutputProcessor(enc.get(), output) != JXL_ENC_SUCCESS)
+    {
+        printf("Failed to write JXL: JxlEncoderSetOutputProcessor failed\n");
+        return false;
+    }
     
     // set basic info
     JxlBasicInfo basic_info;
@@ -332,7 +779,7 @@ bool SaveJxlFile(MyOStream& mem, const Image& image, int cmp_level)
     {
         if (use_rgb)
         {
-            if (idx == rgba.r || idx == rgba.g || idx == rgba.b)
+            if (int(idx) == rgba.r || int(idx) == rgba.g || int(idx) == rgba.b)
                 continue;
         }
         else
@@ -340,9 +787,9 @@ bool SaveJxlFile(MyOStream& mem, const Image& image, int cmp_level)
             if (idx == 0)
                 continue;
         }
-        const Image::Channel& ch = image.channels[idx];
+        const ImageView::Channel& ch = image.channels[idx];
         JxlExtraChannelInfo ec;
-        JxlEncoderInitExtraChannelInfo(use_alpha && idx == rgba.a ? JXL_CHANNEL_ALPHA : JXL_CHANNEL_OPTIONAL, &ec);
+        JxlEncoderInitExtraChannelInfo(use_alpha && int(idx) == rgba.a ? JXL_CHANNEL_ALPHA : JXL_CHANNEL_OPTIONAL, &ec);
         ec.bits_per_sample = ch.fp16 ? 16 : 32;
         ec.exponent_bits_per_sample = ch.fp16 ? 5 : 8;
         JxlEncoderSetExtraChannelInfo(enc.get(), extra_ch_idx, &ec);
@@ -366,187 +813,66 @@ bool SaveJxlFile(MyOStream& mem, const Image& image, int cmp_level)
     JxlEncoderSetFrameLossless(frame, JXL_TRUE);
     if (cmp_level != 0)
         JxlEncoderFrameSettingsSetOption(frame, JXL_ENC_FRAME_SETTING_EFFORT, cmp_level);
+    // streaming input and output for anything larger than one group; without this
+    // libjxl buffers the whole frame and asks for it all at once
+    JxlEncoderFrameSettingsSetOption(frame, JXL_ENC_FRAME_SETTING_BUFFERING, 2);
 
-    // If we have RGB(A), assemble that into interleaved format and pass to JXL
-    const size_t pixel_stride = image.pixels_size / image.width / image.height;
-    std::vector<char> ch_buffer;
-    if (use_rgb && use_alpha)
-    {
-        // RGBA
-        const size_t ch_stride = fp16 ? 2 : 4;
-        const size_t ch_total_size = image.width * image.height * ch_stride * 4;
-        if (ch_buffer.size() < ch_total_size) {
-            ch_buffer.resize(ch_total_size);
-        }
-        const size_t offset_r = image.channels[rgba.r].offset;
-        const size_t offset_g = image.channels[rgba.g].offset;
-        const size_t offset_b = image.channels[rgba.b].offset;
-        const size_t offset_a = image.channels[rgba.a].offset;
-        const char* src = image.pixels.get();
-        char* dst = ch_buffer.data();
-        if (ch_stride == 2)
-        {
-            for (size_t i = 0, n = image.width * image.height; i != n; ++i)
-            {
-                ((uint16_t*)dst)[0] = *(const uint16_t*)(src + offset_r);
-                ((uint16_t*)dst)[1] = *(const uint16_t*)(src + offset_g);
-                ((uint16_t*)dst)[2] = *(const uint16_t*)(src + offset_b);
-                ((uint16_t*)dst)[3] = *(const uint16_t*)(src + offset_a);
-                src += pixel_stride;
-                dst += sizeof(uint16_t) * 4;
-            }
-        }
-        else if (ch_stride == 4)
-        {
-            for (size_t i = 0, n = image.width * image.height; i != n; ++i)
-            {
-                ((uint32_t*)dst)[0] = *(const uint32_t*)(src + offset_r);
-                ((uint32_t*)dst)[1] = *(const uint32_t*)(src + offset_g);
-                ((uint32_t*)dst)[2] = *(const uint32_t*)(src + offset_b);
-                ((uint32_t*)dst)[3] = *(const uint32_t*)(src + offset_a);
-                src += pixel_stride;
-                dst += sizeof(uint32_t) * 4;
-            }
-        }
-        JxlPixelFormat fmt = {4, fp16 ? JXL_TYPE_FLOAT16 : JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
-        if (JxlEncoderAddImageFrame(frame, &fmt, ch_buffer.data(), ch_total_size) != JXL_ENC_SUCCESS)
-        {
-            printf("Failed to write JXL: JxlEncoderAddImageFrame RGBA failed\n");
-            return false;
-        }
-    }
-    else if (use_rgb && !use_alpha)
+    // Frame pixels are extracted from the image as libjxl asks for them: RGB(A) or
+    // the single gray channel interleaved, everything else as planar extra channels,
+    // in the same order as above. Alpha is interleaved with color, but is in the extra
+    // channel list too, to keep indices the same.
+    JxlChunkedSource source;
+    source.width = image.width;
+    source.height = image.height;
+    source.color_count = use_rgb ? (use_alpha ? 4 : 3) : 1;
+    source.color_fp16 = fp16;
+    source.color[0] = &image.channels[use_rgb ? rgba.r : 0];
+    if (use_rgb)
     {
-        // RGB
-        const size_t ch_stride = fp16 ? 2 : 4;
-        const size_t ch_total_size = image.width * image.height * ch_stride * 3;
-        if (ch_buffer.size() < ch_total_size) {
-            ch_buffer.resize(ch_total_size);
-        }
-        const size_t offset_r = image.channels[rgba.r].offset;
-        const size_t offset_g = image.channels[rgba.g].offset;
-        const size_t offset_b = image.channels[rgba.b].offset;
-        const char* src = image.pixels.get();
-        char* dst = ch_buffer.data();
-        if (ch_stride == 2)
-        {
-            for (size_t i = 0, n = image.width * image.height; i != n; ++i)
-            {
-                ((uint16_t*)dst)[0] = *(const uint16_t*)(src + offset_r);
-                ((uint16_t*)dst)[1] = *(const uint16_t*)(src + offset_g);
-                ((uint16_t*)dst)[2] = *(const uint16_t*)(src + offset_b);
-                src += pixel_stride;
-                dst += sizeof(uint16_t) * 3;
-            }
-        }
-        else if (ch_stride == 4)
-        {
-            for (size_t i = 0, n = image.width * image.height; i != n; ++i)
-            {
-                ((uint32_t*)dst)[0] = *(const uint32_t*)(src + offset_r);
-                ((uint32_t*)dst)[1] = *(const uint32_t*)(src + offset_g);
-                ((uint32_t*)dst)[2] = *(const uint32_t*)(src + offset_b);
-                src += pixel_stride;
-                dst += sizeof(uint32_t) * 3;
-            }
-        }
-        JxlPixelFormat fmt = { 3, fp16 ? JXL_TYPE_FLOAT16 : JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0 };
-        if (JxlEncoderAddImageFrame(frame, &fmt, ch_buffer.data(), ch_total_size) != JXL_ENC_SUCCESS)
-        {
-            printf("Failed to write JXL: JxlEncoderAddImageFrame RGB failed\n");
-            return false;
-        }
+        source.color[1] = &image.channels[rgba.g];
+        source.color[2] = &image.channels[rgba.b];
     }
-
-    // add other channels as JXL "extra channels"
-    extra_ch_idx = 0;
+    if (use_alpha)
+        source.color[3] = &image.channels[rgba.a];
     for (size_t idx = 0; idx < image.channels.size(); ++idx)
     {
-        if (use_rgb && (idx == rgba.r || idx == rgba.g || idx == rgba.b))
+        if (use_rgb ? (int(idx) == rgba.r || int(idx) == rgba.g || int(idx) == rgba.b) : idx == 0)
             continue;
-        if (use_alpha && idx == rgba.a)
-        {
-            ++extra_ch_idx; // skip actual work, but count alpha as extra channel index
-            continue;
-        }
-
-        const Image::Channel& ch = image.channels[idx];
-
-        // put channel data into a planar format
-        const size_t ch_stride = ch.fp16 ? 2 : 4;
-        const size_t ch_total_size = image.width * image.height * ch_stride;
-        if (ch_buffer.size() < ch_total_size) {
-            ch_buffer.resize(ch_total_size);
-        }
-        if (ch_stride == 2)
-        {
-            const char* src = image.pixels.get() + ch.offset;
-            char* dst = ch_buffer.data();
-            for (size_t i = 0, n = image.width * image.height; i != n; ++i)
-            {
-                *(uint16_t*)dst = *(const uint16_t*)src;
-                src += pixel_stride;
-                dst += sizeof(uint16_t);
-            }
-        }
-        else if (ch_stride == 4)
-        {
-            const char* src = image.pixels.get() + ch.offset;
-            char* dst = ch_buffer.data();
-            for (size_t i = 0, n = image.width * image.height; i != n; ++i)
-            {
-                *(uint32_t*)dst = *(const uint32_t*)src;
-                src += pixel_stride;
-                dst += sizeof(uint32_t);
-            }
-        }
-        JxlPixelFormat fmt = {1, ch.fp16 ? JXL_TYPE_FLOAT16 : JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
-        if (!use_rgb && idx == 0)
-        {
-            if (JxlEncoderAddImageFrame(frame, &fmt, ch_buffer.data(), ch_total_size) != JXL_ENC_SUCCESS)
-            {
-                printf("Failed to write JXL: JxlEncoderAddImageFrame failed\n");
-                return false;
-            }
-        }
-        else
-        {
-            if (JxlEncoderSetExtraChannelBuffer(frame, &fmt, ch_buffer.data(), ch_total_size, extra_ch_idx) != JXL_ENC_SUCCESS)
-            {
-                printf("Failed to write JXL: JxlEncoderSetExtraChannelBuffer failed\n");
-                return false;
-            }
-            ++extra_ch_idx;
-        }
+        source.extra.push_back(&image.channels[idx]);
+    }
+    JxlChunkedFrameInputSource input = {};
+    input.opaque = &source;
+    input.get_color_channels_pixel_format = JxlChunkedColorFormat;
+    input.get_color_channel_data_at = JxlChunkedColorData;
+    input.get_extra_channel_pixel_format = JxlChunkedExtraFormat;
+    input.get_extra_channel_data_at = JxlChunkedExtraData;
+    input.release_buffer = JxlChunkedRelease;
+    if (JxlEncoderAddChunkedFrame(frame, JXL_TRUE, input) != JXL_ENC_SUCCESS)
+    {
+        printf("Failed to write JXL: JxlEncoderAddChunkedFrame failed\n");
+        return false;
     }
 
+    // encoded data is written through the output processor as it is produced
     JxlEncoderCloseInput(enc.get());
-
-    // encode into buffer
-    std::vector<uint8_t> compressed;
-    compressed.resize(1024 * 1024);
-    uint8_t* next_out = compressed.data();
-    size_t avail_out = compressed.size();
-    JxlEncoderStatus process_result = JXL_ENC_NEED_MORE_OUTPUT;
-    while (process_result == JXL_ENC_NEED_MORE_OUTPUT)
     {
-        process_result = JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out);
-        if (process_result == JXL_ENC_NEED_MORE_OUTPUT)
+        TRACE_SCOPE("JxlEncoderFlushInput");
+        if (JxlEncoderFlushInput(enc.get()) != JXL_ENC_SUCCESS)
         {
-          size_t offset = next_out - compressed.data();
-          compressed.resize(compressed.size() * 2);
-          next_out = compressed.data() + offset;
-          avail_out = compressed.size() - offset;
+            printf("Failed to write JXL: JxlEncoderFlushInput failed %i\n", JxlEncoderGetError(enc.get()));
+            return false;
         }
     }
-    compressed.resize(next_out - compressed.data());
-    if (process_result != JXL_ENC_SUCCESS)
-    {
-        printf("Failed to write JXL: JxlEncoderProcessOutput failed\n");
-        return false;
-    }
-
-    // output
-    mem.write((const char*)compressed.data(), int(next_out - compressed.data()));
+    mem.seekp(mem.size());
     return true;
 }
+
+std::future<bool> SaveJxlFileAsync(MyOStream& mem, const Image& image, int cmp_level)
+{
+    return RunAsync([&mem, &image, cmp_level]() { return SaveJxlFile(mem, image, cmp_level); });
+}
+
+std::future<bool> LoadJxlFileAsync(MyIStream& mem, Image& r_image)
+{
+    return RunAsync([&mem, &r_image]() { return LoadJxlFile(mem, r_image); });
+}
@@ -2,11 +2,18 @@
 
 #include "image.h"
 #include "fileio.h"
+#include <future>
 
 #ifdef INCLUDE_FORMAT_JXL
 
-void InitJxl(int thread_count);
-bool SaveJxlFile(MyOStream& mem, const Image& image, int cmp_level);
+void InitJxl();
+bool SaveJxlFile(MyOStream& mem, const ImageView& image, int cmp_level);
 bool LoadJxlFile(MyIStream &mem, Image& r_image);
+// Loads into the view's channels, matched by name; image size and channel types must match.
+bool LoadJxlFile(MyIStream& mem, const ImageView& dst);
+
+// Same as above, but run on the shared thread pool; arguments have to stay alive until the future is ready.
+std::future<bool> SaveJxlFileAsync(MyOStream& mem, const Image& image, int cmp_level);
+std::future<bool> LoadJxlFileAsync(MyIStream& mem, Image& r_image);
 
 #endif
@@ -4,128 +4,783 @@
 
 #include "image_mop.h"
 #include "fileio.h"
-#define IC_PFOR_IMPLEMENTATION
+#include "threading.h"
 #include "ic_pfor.h"
+#include "trace.h"
+#include "simd.h"
 
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
 
 constexpr size_t kChunkSize = 16 * 1024;
 
 static int s_mop_thread_count;
 
-void InitMop(int thread_count)
+// Growable buffer; contents are not preserved nor initialized when it grows.
+struct ScratchBuffer
 {
-    s_mop_thread_count = ic::init_pfor(thread_count);
+    PixelBuffer data;
+    size_t capacity = 0;
+
+    char* get(size_t size)
+    {
+        if (size > capacity)
+        {
+            data = MakePixelBuffer(size);
+            capacity = size;
+        }
+        return data.get();
+    }
+};
+
+// Per worker thread state, indexed by ic::pfor thread index. These are
+// reused across chunks and across files, to avoid zstd context setup and
+// memory allocations for each chunk.
+struct MopThreadState
+{
+    ZSTD_CCtx* cctx = nullptr;
+    ZSTD_DCtx* dctx = nullptr;
+    ScratchBuffer padded; // encoder: padded or gathered chunk pixels
+    ScratchBuffer pixels; // decoder: decoded chunk pixels
+    ScratchBuffer filter_tmp; // one pixel for filters that permute bytes
+    ScratchBuffer encoded; // mesh optimizer output, before zstd compression
+    ScratchBuffer decompressed; // zstd decompression output
+};
+static std::unique_ptr<MopThreadState[]> s_mop_threads;
+
+void InitMop()
+{
+    s_mop_thread_count = GetThreadCount();
+    s_mop_threads.reset(new MopThreadState[s_mop_thread_count]);
 }
 void ShutdownMop()
 {
-    ic::shut_pfor();
+    for (int i = 0; i < s_mop_thread_count; ++i)
+    {
+        ZSTD_freeCCtx(s_mop_threads[i].cctx);
+        ZSTD_freeDCtx(s_mop_threads[i].dctx);
+    }
+    s_mop_threads.reset();
 }
 
 // File format:
 // uchar4   magic MOPF
 // int32    width
 // int32    height
-// int32    flags 1=zstd
+// int32    flags 1=zstd, 2=tiled, bits 2..3 filter (see MopFilter), 16=chunk modes, 32=paired pixels,
+//          64=channel groups
+// int32    tilesize (only if tiled flag is set)
 // int32    nchannels
 // for nchannels:
 //      int32   type (0=fp16, 1=fp32)
 //      int32   namelen
 //      char[namelen] name
-// int64[chunkcount] compressed chunk sizes
+// int32    ngroups (only if channel groups flag is set)
+// int32[ngroups] channel count of each group
+// int64[ngroups*chunkcount] compressed chunk sizes
+//
+// Channel groups are runs of consecutive channels; each group is compressed
+// as a separate stream of chunks, so that loading a subset of channels only
+// needs to decode the groups that contain them. Chunks are stored group after
+// group. Without channel groups flag, all channels are one group.
+// Chunks are either runs of kChunkSize pixels in scanline order, or
+// (if tiled flag is set) tilesize*tilesize pixel tiles in row-major
+// tile order; edge tiles are clipped to image size. The chunk size table
+// acts as an index to find any chunk/tile in the file.
+// With chunk modes flag, each chunk data starts with a MopChunkMode byte;
+// otherwise all chunks are mesh optimizer (+zstd if that flag is set) data.
+// Mesh optimizer needs vertex size to be a multiple of 4. Pixel size is always
+// a multiple of 2, and if it is not a multiple of 4, then either each pixel is
+// padded with zeroes, or (with paired pixels flag) each vertex is two pixels;
+// with an odd pixel count the last vertex is padded with a zero pixel.
 
+constexpr int32_t kFlagZstd = 1;
+constexpr int32_t kFlagTiled = 2;
+constexpr int32_t kFlagFilterShift = 2;
+constexpr int32_t kFlagFilterMask = 3 << kFlagFilterShift;
+constexpr int32_t kFlagChunkModes = 16;
+constexpr int32_t kFlagPairedPixels = 32;
+constexpr int32_t kFlagChannelGroups = 64;
+constexpr int32_t kFlagsKnown = kFlagZstd | kFlagTiled | kFlagFilterMask | kFlagChunkModes | kFlagPairedPixels | kFlagChannelGroups;
 
-bool LoadMopFile(MyIStream &mem, Image& r_image)
+enum MopChunkMode : uint8_t
+{
+    kChunkConstant = 0, // single pixel value (not filtered, not padded) for the whole chunk
+    kChunkRaw = 1, // uncompressed (filtered, padded) pixel data
+    kChunkMeshopt = 2,
+    kChunkMeshoptZstd = 3,
+};
+
+// Reversible transforms applied to chunk pixel data before mesh optimizer
+// encoding, and undone after decoding.
+enum MopFilter
+{
+    kFilterNone = 0,
+    kFilterSignRemap = 1, // negative values get non-sign bits flipped (high 16 bits only for fp32)
+    kFilterXorLeft = 2, // each pixel XOR-ed with the previous one
+    kFilterBytePlanes = 3, // within each pixel, most significant bytes of all channels first, then next ones etc.
+};
+constexpr size_t kTileSize = 128; // 128x128 tiles have the same pixel count as kChunkSize
+
+// One channel group, compressed as a separate stream of chunks
+struct MopGroup
+{
+    size_t first_channel = 0;
+    size_t channel_count = 0;
+    size_t image_offset = 0; // offset of group data within the whole image pixel
+    size_t pixel_stride = 0; // group data size within the pixel
+    size_t coded_stride = 0; // pixel size in chunk data, including padding
+    size_t vertex_size = 0; // mesh optimizer vertex size
+    size_t chunk_buffer_size = 0; // temporary buffer size for decoded chunk pixels
+    bool paired = false;
+    std::vector<std::pair<size_t, size_t>> chunk_start_size;
+    std::vector<uint16_t> filter_lanes; // kFilterSignRemap: flip masks for 8 pixels worth of 16 bit lanes
+    std::vector<uint32_t> filter_perm; // kFilterBytePlanes: source byte for each coded pixel byte
+};
+
+struct MopHeader
 {
-    size_t pixel_stride = 0;
     bool zstd = false;
+    bool chunk_modes = false;
+    bool pair_pixels = false;
+    bool channel_groups = false;
+    size_t width = 0;
+    size_t height = 0;
+    size_t tile_size = 0; // 0 if not tiled
+    size_t tiles_x = 0;
+    size_t pixel_stride = 0;
+    size_t pixel_count = 0;
+    size_t chunk_count = 0; // per group
+    int filter = kFilterNone;
+    std::vector<MopGroup> groups;
+};
 
-    // header
+// Splits channels into groups by layer name (part before the last dot),
+// e.g. "diffuse.R", "diffuse.G", "diffuse.B" go into one group. Without
+// channel groups, all channels are put into one group.
+static void SplitMopChannelGroups(MopHeader& header, const std::vector<Image::Channel>& channels)
+{
+    header.groups.clear();
+    std::string prev_layer;
+    for (size_t i = 0; i < channels.size(); ++i)
+    {
+        const std::string& name = channels[i].name;
+        const size_t dot = name.rfind('.');
+        const std::string layer = dot == std::string::npos ? std::string() : name.substr(0, dot);
+        if (header.groups.empty() || (header.channel_groups && layer != prev_layer))
+        {
+            header.groups.emplace_back();
+            header.groups.back().first_channel = i;
+        }
+        header.groups.back().channel_count++;
+        prev_layer = layer;
+    }
+}
+
+static void SetupMopChunks(MopHeader& header, const std::vector<Image::Channel>& channels)
+{
+    header.pixel_count = header.width * header.height;
+    size_t max_chunk_pixels = 0;
+    if (header.tile_size != 0)
+    {
+        header.tiles_x = (header.width + header.tile_size - 1) / header.tile_size;
+        const size_t tiles_y = (header.height + header.tile_size - 1) / header.tile_size;
+        header.chunk_count = header.tiles_x * tiles_y;
+        // tile size comes from the file, and can be larger than kChunkSize pixels
+        max_chunk_pixels = std::min(header.tile_size, header.width) * std::min(header.tile_size, header.height);
+    }
+    else
+    {
+        header.chunk_count = (header.pixel_count + kChunkSize - 1) / kChunkSize;
+        max_chunk_pixels = std::min(kChunkSize, header.pixel_count);
+    }
+
+    size_t offset = 0;
+    for (MopGroup& group : header.groups)
+    {
+        group.image_offset = offset;
+        group.pixel_stride = 0;
+        for (size_t i = 0; i < group.channel_count; ++i)
+            group.pixel_stride += channels[group.first_channel + i].fp16 ? 2 : 4;
+        offset += group.pixel_stride;
+
+        group.paired = header.pair_pixels && group.pixel_stride % 4 != 0;
+        if (group.paired)
+        {
+            group.coded_stride = group.pixel_stride;
+            group.vertex_size = group.pixel_stride * 2;
+        }
+        else
+        {
+            group.coded_stride = (group.pixel_stride + 3) / 4 * 4; // mesh optimizer requires stride to be multiple of 4
+            group.vertex_size = group.coded_stride;
+        }
+        group.chunk_buffer_size = (max_chunk_pixels + 1) * group.coded_stride; // +1 for padding pixel of odd sized paired chunks
+    }
+    header.pixel_stride = offset;
+}
+
+static void SetupMopFilter(const MopHeader& header, MopGroup& group, const std::vector<Image::Channel>& channels)
+{
+    // note: channel offsets are computed from channel order here, same as file reading does
+    const Image::Channel* group_channels = channels.data() + group.first_channel;
+    if (header.filter == kFilterSignRemap)
+    {
+        // masks for 8 pixels, so that it is a multiple of 8 lanes for SIMD processing
+        const size_t lanes = group.coded_stride / 2;
+        group.filter_lanes.assign(lanes * 8, 0);
+        for (size_t pix = 0; pix < 8; ++pix)
+        {
+            size_t offset = 0;
+            for (size_t i = 0; i < group.channel_count; ++i)
+            {
+                const Image::Channel& ch = group_channels[i];
+                group.filter_lanes[pix * lanes + offset / 2 + (ch.fp16 ? 0 : 1)] = 0x7FFF;
+                offset += ch.fp16 ? 2 : 4;
+            }
+        }
+    }
+    if (header.filter == kFilterBytePlanes)
+    {
+        group.filter_perm.clear();
+        for (size_t plane = 0; plane < 4; ++plane)
+        {
+            size_t offset = 0;
+            for (size_t i = 0; i < group.channel_count; ++i)
+            {
+                const size_t size = group_channels[i].fp16 ? 2 : 4;
+                if (plane < size)
+                    group.filter_perm.push_back(uint32_t(offset + size - 1 - plane)); // little endian
+                offset += size;
+            }
+        }
+        for (size_t i = group.pixel_stride; i < group.coded_stride; ++i)
+            group.filter_perm.push_back(uint32_t(i));
+    }
+}
+
+// Reads file header and chunk size table; fills in image size & channels
+// (but does not allocate pixels).
+static bool ReadMopHeader(MyIStream& mem, Image& r_image, MopHeader& r_header)
+{
+    char magic[4];
+    mem.read(magic);
+    if (memcmp(magic, "MOPF", 4) != 0)
+        return false;
+    int32_t width = 0, height = 0, flags = 0, chCount = 0;
+    mem.read(width);
+    mem.read(height);
+    mem.read(flags);
+    if (flags & ~kFlagsKnown)
+        return false;
+    if (flags & kFlagZstd)
+        r_header.zstd = true;
+    if (flags & kFlagChunkModes)
+        r_header.chunk_modes = true;
+    if (flags & kFlagPairedPixels)
+        r_header.pair_pixels = true;
+    if (flags & kFlagChannelGroups)
+        r_header.channel_groups = true;
+    r_header.filter = (flags & kFlagFilterMask) >> kFlagFilterShift;
+    if (flags & kFlagTiled)
     {
-        char magic[4];
-        mem.read(magic);
-        if (memcmp(magic, "MOPF", 4) != 0)
+        int32_t tileSize = 0;
+        mem.read(tileSize);
+        if (tileSize < 1 || tileSize > 64 * 1024)
             return false;
-        int32_t width = 0, height = 0, flags = 0, chCount = 0;
-        mem.read(width);
-        mem.read(height);
-        mem.read(flags);
-        if (flags & 1)
-            zstd = true;
-        mem.read(chCount);
-        if (width < 1 || width > 1024 * 1024 * 1024 || height < 1 || height > 1024 * 1024 * 1024 || chCount < 1 || chCount > 1024 * 1024)
+        r_header.tile_size = tileSize;
+    }
+    mem.read(chCount);
+    if (width < 1 || width > 1024 * 1024 * 1024 || height < 1 || height > 1024 * 1024 * 1024 || chCount < 1 || chCount > 1024 * 1024)
+        return false;
+    r_image.width = width;
+    r_image.height = height;
+    r_image.channels.reserve(chCount);
+    for (int ich = 0; ich < chCount; ++ich)
+    {
+        int32_t type = 0, nameLen = 0;
+        mem.read(type);
+        mem.read(nameLen);
+        if (type < 0 || type > 1)
+            return false;
+        if (nameLen < 0 || nameLen > 1024 * 1024)
             return false;
-        r_image.width = width;
-        r_image.height = height;
-        r_image.channels.reserve(chCount);
-        for (int ich = 0; ich < chCount; ++ich)
-        {
-            int32_t type = 0, nameLen = 0;
-            mem.read(type);
-            mem.read(nameLen);
-            if (type < 0 || type > 1)
+
+        Image::Channel ch = {};
+        ch.fp16 = type == 0;
+        ch.name.resize(nameLen);
+        mem.read(ch.name.data(), int(ch.name.size()));
+        ch.offset = r_header.pixel_stride;
+        r_header.pixel_stride += ch.fp16 ? 2 : 4;
+        r_image.channels.emplace_back(ch);
+    }
+
+    if (r_header.channel_groups)
+    {
+        int32_t groupCount = 0;
+        mem.read(groupCount);
+        if (groupCount < 1 || groupCount > chCount)
+            return false;
+        r_header.groups.resize(groupCount);
+        size_t first_channel = 0;
+        for (MopGroup& group : r_header.groups)
+        {
+            int32_t groupChannels = 0;
+            mem.read(groupChannels);
+            if (groupChannels < 1 || groupChannels > chCount - int32_t(first_channel))
                 return false;
-            if (nameLen < 0 || nameLen > 1024 * 1024)
+            group.first_channel = first_channel;
+            group.channel_count = groupChannels;
+            first_channel += groupChannels;
+        }
+        if (first_channel != size_t(chCount))
+            return false;
+    }
+    else
+    {
+        SplitMopChannelGroups(r_header, r_image.channels);
+    }
+
+    r_header.width = r_image.width;
+    r_header.height = r_image.height;
+    SetupMopChunks(r_header, r_image.channels);
+    for (MopGroup& group : r_header.groups)
+    {
+        SetupMopFilter(r_header, group, r_image.channels);
+        // the size table has to fit into the file; do not allocate it otherwise
+        if (mem.tellg() > mem.size() || r_header.chunk_count > (mem.size() - mem.tellg()) / sizeof(size_t))
+            return false;
+        group.chunk_start_size.resize(r_header.chunk_count);
+        for (auto& chunk : group.chunk_start_size)
+        {
+            mem.read(chunk.second);
+        }
+    }
+    size_t pos = mem.tellg();
+    if (pos > mem.size())
+        return false;
+    for (MopGroup& group : r_header.groups)
+    {
+        for (auto& chunk : group.chunk_start_size)
+        {
+            // check against what is left, so that corrupt sizes can not wrap around
+            if (chunk.second > mem.size() - pos)
                 return false;
+            chunk.first = pos;
+            pos += chunk.second;
+        }
+    }
+    return true;
+}
+
+struct TileRect
+{
+    size_t x, y, w, h;
+};
+
+static TileRect GetTileRect(const MopHeader& header, size_t index)
+{
+    TileRect r;
+    r.x = index % header.tiles_x * header.tile_size;
+    r.y = index / header.tiles_x * header.tile_size;
+    r.w = std::min(header.tile_size, header.width - r.x);
+    r.h = std::min(header.tile_size, header.height - r.y);
+    return r;
+}
+
+static size_t GetChunkPixelCount(const MopHeader& header, size_t index)
+{
+    if (header.tile_size != 0)
+    {
+        TileRect r = GetTileRect(header, index);
+        return r.w * r.h;
+    }
+    return index == header.chunk_count - 1 ? header.pixel_count - index * kChunkSize : kChunkSize;
+}
+
+static size_t GetChunkVertexCount(const MopGroup& group, size_t pixel_count)
+{
+    return group.paired ? (pixel_count + 1) / 2 : pixel_count;
+}
+
+// Is chunk data laid out the same as image pixels, i.e. can be decoded directly
+// into / encoded directly from an image with image_stride sized pixels?
+static bool IsChunkSameAsImage(const MopHeader& header, const MopGroup& group, size_t pixel_count, size_t image_stride)
+{
+    return header.tile_size == 0 && group.pixel_stride == image_stride && group.coded_stride == image_stride && (!group.paired || pixel_count % 2 == 0);
+}
+
+// Copies pixels between buffers that might have different pixel strides (e.g. padded & unpadded)
+static void CopyPixels(char* dst, size_t dst_stride, const char* src, size_t src_stride, size_t pixel_stride, size_t count)
+{
+    if (dst_stride == pixel_stride && src_stride == pixel_stride)
+    {
+        memcpy(dst, src, count * pixel_stride);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        memcpy(dst, src, pixel_stride);
+        src += src_stride;
+        dst += dst_stride;
+    }
+}
+
+// Copies pixel_stride bytes of each source pixel into a buffer with a possibly larger (padded)
+// pixel stride, zeroing the padding bytes
+static void PadPixels(char* dst, size_t coded_stride, const char* src, size_t src_stride, size_t pixel_stride, size_t count)
+{
+    if (coded_stride == pixel_stride)
+    {
+        CopyPixels(dst, coded_stride, src, src_stride, pixel_stride, count);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        memcpy(dst, src, pixel_stride);
+        memset(dst + pixel_stride, 0, coded_stride - pixel_stride);
+        src += src_stride;
+        dst += coded_stride;
+    }
+}
+
+// Part of decoded group pixel data that goes into destination image pixel
+struct CopySpan
+{
+    size_t src_offset, dst_offset, size;
+};
+
+static void CopyPixelSpans(char* dst, size_t dst_stride, const char* src, size_t src_stride, const std::vector<CopySpan>& spans, size_t count)
+{
+    if (spans.size() == 1)
+    {
+        CopyPixels(dst + spans[0].dst_offset, dst_stride, src + spans[0].src_offset, src_stride, spans[0].size, count);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        for (const CopySpan& span : spans)
+            memcpy(dst + span.dst_offset, src + span.src_offset, span.size);
+        src += src_stride;
+        dst += dst_stride;
+    }
+}
+
+static void FilterSignRemap(char* data, size_t count, const MopGroup& group)
+{
+    // the transform is its own inverse, since sign bits are not modified
+    uint16_t* ptr = (uint16_t*)data;
+    const uint16_t* masks = group.filter_lanes.data();
+    const size_t period = group.filter_lanes.size();
+    const size_t n = count * group.coded_stride / 2;
+    size_t i = 0, m = 0;
+#if SIMD_SSE2
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(ptr + i));
+        __m128i mask = _mm_loadu_si128((const __m128i*)(masks + m));
+        v = _mm_xor_si128(v, _mm_and_si128(_mm_srai_epi16(v, 15), mask));
+        _mm_storeu_si128((__m128i*)(ptr + i), v);
+        m += 8;
+        if (m == period)
+            m = 0;
+    }
+#elif SIMD_NEON
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(ptr + i);
+        uint16x8_t mask = vld1q_u16(masks + m);
+        uint16x8_t neg = vreinterpretq_u16_s16(vshrq_n_s16(vreinterpretq_s16_u16(v), 15));
+        vst1q_u16(ptr + i, veorq_u16(v, vandq_u16(neg, mask)));
+        m += 8;
+        if (m == period)
+            m = 0;
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        const uint16_t v = ptr[i];
+        ptr[i] = v ^ ((v & 0x8000) ? masks[m] : 0);
+        if (++m == period)
+            m = 0;
+    }
+}
 
-            Image::Channel ch = {};
-            ch.fp16 = type == 0;
-            ch.name.resize(nameLen);
-            mem.read(ch.name.data(), int(ch.name.size()));
-            ch.offset = pixel_stride;
-            pixel_stride += ch.fp16 ? 2 : 4;
-            r_image.channels.emplace_back(ch);
+static void FilterXorLeft(char* data, size_t count, size_t stride, bool inverse)
+{
+    // work on 16 bit words; stride is always a multiple of 2
+    uint16_t* ptr = (uint16_t*)data;
+    const size_t n = count * stride / 2;
+    const size_t s = stride / 2;
+    if (!inverse)
+    {
+        // going backwards, so that inputs are still the original values
+        size_t i = n;
+#if SIMD_SSE2
+        for (; i >= s + 8; i -= 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(ptr + i - 8));
+            __m128i left = _mm_loadu_si128((const __m128i*)(ptr + i - 8 - s));
+            _mm_storeu_si128((__m128i*)(ptr + i - 8), _mm_xor_si128(v, left));
+        }
+#elif SIMD_NEON
+        for (; i >= s + 8; i -= 8)
+            vst1q_u16(ptr + i - 8, veorq_u16(vld1q_u16(ptr + i - 8), vld1q_u16(ptr + i - 8 - s)));
+#endif
+        for (; i > s; --i)
+            ptr[i - 1] ^= ptr[i - 1 - s];
+    }
+    else
+    {
+        // going forward, each pixel depends on already decoded previous one;
+        // SIMD only when whole vector width is within one pixel
+        size_t i = s;
+#if SIMD_SSE2
+        if (s >= 8)
+        {
+            for (; i + 8 <= n; i += 8)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(ptr + i));
+                __m128i left = _mm_loadu_si128((const __m128i*)(ptr + i - s));
+                _mm_storeu_si128((__m128i*)(ptr + i), _mm_xor_si128(v, left));
+            }
+        }
+#elif SIMD_NEON
+        if (s >= 8)
+        {
+            for (; i + 8 <= n; i += 8)
+                vst1q_u16(ptr + i, veorq_u16(vld1q_u16(ptr + i), vld1q_u16(ptr + i - s)));
         }
+#endif
+        for (; i < n; ++i)
+            ptr[i] ^= ptr[i - s];
     }
+}
 
-    const size_t pixel_count = r_image.width * r_image.height;
-    r_image.pixels_size = pixel_count * pixel_stride;
-    r_image.pixels = std::unique_ptr<char[]>(new char[r_image.pixels_size]);
+static void FilterBytePlanes(char* data, size_t count, const MopGroup& group, bool inverse, char* tmp)
+{
+    const size_t stride = group.coded_stride;
+    const uint32_t* perm = group.filter_perm.data();
+    for (size_t i = 0; i < count; ++i, data += stride)
+    {
+        memcpy(tmp, data, stride);
+        if (inverse)
+        {
+            for (size_t j = 0; j < stride; ++j)
+                data[perm[j]] = tmp[j];
+        }
+        else
+        {
+            for (size_t j = 0; j < stride; ++j)
+                data[j] = tmp[perm[j]];
+        }
+    }
+}
 
-    size_t chunk_count = (pixel_count + kChunkSize - 1) / kChunkSize;
-    const size_t coded_stride = (pixel_stride + 3) / 4 * 4; // mesh optimizer requires stride to be multiple of 4
+// Applies (or undoes) the filter on count pixels of coded_stride size each.
+static void ApplyMopFilter(char* data, size_t count, const MopHeader& header, const MopGroup& group, bool inverse, MopThreadState& ts)
+{
+    switch (header.filter)
+    {
+    case kFilterSignRemap: FilterSignRemap(data, count, group); break;
+    case kFilterXorLeft: FilterXorLeft(data, count, group.coded_stride, inverse); break;
+    case kFilterBytePlanes: FilterBytePlanes(data, count, group, inverse, ts.filter_tmp.get(group.coded_stride)); break;
+    default: break;
+    }
+}
 
-    std::vector<std::pair<size_t, size_t>> chunk_start_size(chunk_count);
-    for (auto& chunk : chunk_start_size)
+// Fills count pixels with the first one, copying in doubling sizes
+// (so that most of the work is in large, SIMD-friendly memcpy calls).
+static void FillPixels(char* data, size_t stride, size_t count)
+{
+    size_t filled = 1;
+    while (filled < count)
     {
-        mem.read(chunk.second);
+        const size_t n = std::min(filled, count - filled);
+        memcpy(data + filled * stride, data, n * stride);
+        filled += n;
     }
-    uint64_t pos = mem.tellg();
-    for (auto& chunk : chunk_start_size)
+}
+
+// Decodes chunk data into dst, with coded_stride bytes per pixel. With paired pixels and
+// odd pixel count, dst needs to have space for one extra pixel.
+static bool DecodeMopChunk(const MyIStream& mem, const MopHeader& header, const MopGroup& group, size_t index, char* dst, MopThreadState& ts)
+{
+    TRACE_SCOPE("DecodeMopChunk");
+    const size_t encStart = group.chunk_start_size[index].first;
+    const size_t encSize = group.chunk_start_size[index].second;
+
+    const uint8_t* decode_src = (const uint8_t*)mem.data() + encStart;
+    size_t decode_size = encSize;
+    const size_t chunk_pixel_count = GetChunkPixelCount(header, index);
+    MopChunkMode mode = header.zstd ? kChunkMeshoptZstd : kChunkMeshopt;
+    if (header.chunk_modes)
     {
-        chunk.first = pos;
-        pos += chunk.second;
+        if (decode_size < 1)
+            return false;
+        mode = MopChunkMode(decode_src[0]);
+        ++decode_src;
+        --decode_size;
     }
 
-    bool ok = true;
-    // if we need to add padding, reuse the padding buffers between work item invocations
-    std::unique_ptr<char[]> padded_buffer;
-    if (coded_stride != pixel_stride)
+    if (mode == kChunkConstant)
+    {
+        if (decode_size != group.pixel_stride)
+            return false;
+        memcpy(dst, decode_src, group.pixel_stride);
+        memset(dst + group.pixel_stride, 0, group.coded_stride - group.pixel_stride);
+        FillPixels(dst, group.coded_stride, chunk_pixel_count);
+        return true;
+    }
+    if (mode == kChunkRaw)
     {
-        padded_buffer.reset(new char[s_mop_thread_count * kChunkSize * coded_stride]);
+        if (decode_size != chunk_pixel_count * group.coded_stride)
+            return false;
+        memcpy(dst, decode_src, decode_size);
+        ApplyMopFilter(dst, chunk_pixel_count, header, group, true, ts);
+        return true;
+    }
+    if (mode == kChunkMeshoptZstd)
+    {
+        const unsigned long long z_size = ZSTD_getFrameContentSize(decode_src, decode_size);
+        if (z_size == ZSTD_CONTENTSIZE_UNKNOWN || z_size == ZSTD_CONTENTSIZE_ERROR)
+            return false;
+        // the encoder never compresses more than the mesh optimizer bound; a larger size
+        // is a corrupt file, and would make us allocate whatever it says
+        if (z_size > meshopt_encodeVertexBufferBound(GetChunkVertexCount(group, chunk_pixel_count), group.vertex_size))
+            return false;
+        if (ts.dctx == nullptr)
+            ts.dctx = ZSTD_createDCtx();
+        uint8_t* z_buf = (uint8_t*)ts.decompressed.get(size_t(z_size));
+        if (ZSTD_isError(ZSTD_decompressDCtx(ts.dctx, z_buf, size_t(z_size), decode_src, decode_size)))
+            return false;
+        decode_src = z_buf;
+        decode_size = size_t(z_size);
     }
 
-    ic::pfor(unsigned(chunk_count), 1, [&](int index, int thread_index) {
-        const size_t encStart = chunk_start_size[index].first;
-        const size_t encSize = chunk_start_size[index].second;
-        
-        const uint8_t* decode_src = (const uint8_t*)mem.data() + encStart;
-        size_t decode_size = encSize;
-        std::unique_ptr<uint8_t[]> z_buf;
-        if (zstd)
+    else if (mode != kChunkMeshopt)
+    {
+        return false;
+    }
+
+    if (meshopt_decodeVertexBuffer(dst, GetChunkVertexCount(group, chunk_pixel_count), group.vertex_size, decode_src, decode_size) != 0)
+        return false;
+    ApplyMopFilter(dst, chunk_pixel_count, header, group, true, ts);
+    return true;
+}
+
+// Channel group that needs to be decoded, and which parts of its pixels go where in destination image
+struct MopGroupLoad
+{
+    const MopGroup* group = nullptr;
+    std::vector<CopySpan> spans; // for interleaved destination
+    std::vector<std::pair<size_t, size_t>> view_channels; // otherwise: offset within group pixel, view channel index
+};
+
+// Where decoded pixels go: interleaved pixels with rows right after each other,
+// or if data is null, individual channels of an image view
+struct MopDest
+{
+    char* data = nullptr;
+    size_t pixel_stride = 0;
+    size_t width = 0;
+    const ImageView* view = nullptr;
+};
+
+// Copies count decoded group pixels (coded_stride apart) into destination row y, starting at x
+static void WriteGroupPixels(const MopDest& dest, const MopGroupLoad& load, const char* src, size_t coded_stride, size_t x, size_t y, size_t count)
+{
+    if (dest.data != nullptr)
+    {
+        CopyPixelSpans(dest.data + (y * dest.width + x) * dest.pixel_stride, dest.pixel_stride, src, coded_stride, load.spans, count);
+        return;
+    }
+    for (const auto& vc : load.view_channels)
+    {
+        const ImageView::Channel& ch = dest.view->channels[vc.second];
+        CopyPixels(ch.at(x, y), ch.x_stride, src + vc.first, coded_stride, ch.fp16 ? 2 : 4, count);
+    }
+}
+
+// Picks channels to load (all if names list is empty), in file order; replaces r_image channels
+// with them and figures out which channel groups need to be decoded.
+static bool SelectMopChannels(const MopHeader& header, const std::vector<std::string>& names, Image& r_image, size_t& r_pixel_stride, std::vector<MopGroupLoad>& r_loads)
+{
+    std::vector<Image::Channel> file_channels;
+    file_channels.swap(r_image.channels);
+    for (const std::string& name : names)
+    {
+        auto it = std::find_if(file_channels.begin(), file_channels.end(), [&](const Image::Channel& ch) { return ch.name == name; });
+        if (it == file_channels.end())
         {
-            const size_t z_size = ZSTD_getFrameContentSize(decode_src, decode_size);
-            z_buf = std::unique_ptr<uint8_t[]>(new uint8_t[z_size]);
-            ZSTD_decompress(z_buf.get(), z_size, decode_src, decode_size);
-            decode_src = z_buf.get();
-            decode_size = z_size;
+            printf("MOP file does not have channel %s\n", name.c_str());
+            return false;
         }
+    }
 
-        const size_t chunk_pixel_count = index == chunk_count - 1 ? pixel_count - index * kChunkSize : kChunkSize;
-        char* dst_data = r_image.pixels.get() + index * kChunkSize * pixel_stride;
-        if (coded_stride == pixel_stride)
+    size_t dst_offset = 0;
+    for (const MopGroup& group : header.groups)
+    {
+        MopGroupLoad load;
+        load.group = &group;
+        for (size_t i = group.first_channel; i < group.first_channel + group.channel_count; ++i)
         {
-            if (meshopt_decodeVertexBuffer(dst_data, chunk_pixel_count, coded_stride, decode_src, decode_size) != 0)
+            Image::Channel ch = file_channels[i];
+            if (!names.empty() && std::find(names.begin(), names.end(), ch.name) == names.end())
+                continue;
+            const size_t size = ch.fp16 ? 2 : 4;
+            const size_t src_offset = ch.offset - group.image_offset;
+            // destination offsets within a group are always contiguous; merge if source is too
+            if (!load.spans.empty() && load.spans.back().src_offset + load.spans.back().size == src_offset)
+                load.spans.back().size += size;
+            else
+                load.spans.push_back({src_offset, dst_offset, size});
+            ch.offset = dst_offset;
+            dst_offset += size;
+            r_image.channels.push_back(ch);
+        }
+        if (!load.spans.empty())
+            r_loads.emplace_back(std::move(load));
+    }
+    r_pixel_stride = dst_offset;
+    return true;
+}
+
+// Decodes all chunks of the given groups into the destination
+static bool DecodeMopChunks(const MyIStream& mem, const MopHeader& header, const std::vector<MopGroupLoad>& loads, const MopDest& dest)
+{
+    const size_t chunk_count = header.chunk_count;
+    // each thread decodes a contiguous run of chunks, so that it writes into adjacent memory
+    std::atomic<bool> ok(true);
+    ic::pfor(unsigned(loads.size() * chunk_count), 0, [&](int job_index, int thread_index) {
+        MopThreadState& ts = s_mop_threads[thread_index];
+        const MopGroupLoad& load = loads[job_index / chunk_count];
+        const MopGroup& group = *load.group;
+        const size_t index = job_index % chunk_count;
+        const size_t coded_stride = group.coded_stride;
+        const size_t chunk_pixel_count = GetChunkPixelCount(header, index);
+        if (header.tile_size != 0)
+        {
+            // decode into temporary buffer, then scatter tile rows
+            char* tile_data = ts.pixels.get(group.chunk_buffer_size);
+            if (!DecodeMopChunk(mem, header, group, index, tile_data, ts))
+            {
+                ok = false;
+                return;
+            }
+            const TileRect tile = GetTileRect(header, index);
+            for (size_t y = 0; y < tile.h; ++y)
+                WriteGroupPixels(dest, load, tile_data + y * tile.w * coded_stride, coded_stride, tile.x, tile.y + y, tile.w);
+            return;
+        }
+
+        // decode directly into destination if this group is the whole destination pixel
+        if (dest.data != nullptr && load.spans[0].size == dest.pixel_stride && IsChunkSameAsImage(header, group, chunk_pixel_count, dest.pixel_stride))
+        {
+            if (!DecodeMopChunk(mem, header, group, index, dest.data + index * kChunkSize * dest.pixel_stride, ts))
             {
                 ok = false;
                 return;
@@ -133,30 +788,422 @@ bool LoadMopFile(MyIStream &mem, Image& r_image)
         }
         else
         {
-            char* padded_data = padded_buffer.get() + kChunkSize * coded_stride * thread_index;
-            if (meshopt_decodeVertexBuffer(padded_data, chunk_pixel_count, coded_stride, decode_src, decode_size) != 0)
+            char* padded_data = ts.pixels.get(group.chunk_buffer_size);
+            if (!DecodeMopChunk(mem, header, group, index, padded_data, ts))
             {
                 ok = false;
                 return;
             }
-            const char* src = padded_data;
-            char* dst = dst_data;
-            for (size_t i = 0; i < chunk_pixel_count; ++i)
+            if (dest.data != nullptr)
             {
-                memcpy(dst, src, pixel_stride);
-                src += coded_stride;
-                dst += pixel_stride;
+                CopyPixelSpans(dest.data + index * kChunkSize * dest.pixel_stride, dest.pixel_stride, padded_data, coded_stride, load.spans, chunk_pixel_count);
+                return;
             }
+            // chunk pixels in scanline order, split into view rows
+            size_t pos = index * kChunkSize;
+            for (size_t i = 0; i < chunk_pixel_count; )
+            {
+                const size_t x = pos % header.width, y = pos / header.width;
+                const size_t count = std::min(chunk_pixel_count - i, header.width - x);
+                WriteGroupPixels(dest, load, padded_data + i * coded_stride, coded_stride, x, y, count);
+                i += count;
+                pos += count;
+            }
+        }
+        }, ic::ScheduleContiguous);
+
+    return ok;
+}
+
+bool LoadMopFile(MyIStream &mem, Image& r_image, const std::vector<std::string>& channels)
+{
+    TRACE_SCOPE("LoadMopFile");
+    MopHeader header;
+    if (!ReadMopHeader(mem, r_image, header))
+        return false;
+    MopDest dest;
+    std::vector<MopGroupLoad> loads;
+    if (!SelectMopChannels(header, channels, r_image, dest.pixel_stride, loads))
+        return false;
+
+    r_image.pixels_size = header.pixel_count * dest.pixel_stride;
+    r_image.pixels = MakePixelBuffer(r_image.pixels_size);
+    dest.data = r_image.pixels.get();
+    dest.width = header.width;
+    return DecodeMopChunks(mem, header, loads, dest);
+}
+
+bool LoadMopFile(MyIStream& mem, const ImageView& dst)
+{
+    TRACE_SCOPE("LoadMopFile");
+    MopHeader header;
+    Image file_image;
+    if (!ReadMopHeader(mem, file_image, header))
+        return false;
+    if (header.width != dst.width || header.height != dst.height)
+    {
+        printf("MOP file size %zix%zi does not match destination %zix%zi\n", header.width, header.height, dst.width, dst.height);
+        return false;
+    }
+
+    // interleaved destination can use the same span copies as loading into an image
+    MopDest dest;
+    dest.pixel_stride = dst.GetInterleavedStride(dest.data);
+    if (dest.pixel_stride == 0)
+        dest.data = nullptr;
+    dest.width = header.width;
+    dest.view = &dst;
+
+    std::vector<MopGroupLoad> group_loads(header.groups.size());
+    for (size_t di = 0; di < dst.channels.size(); ++di)
+    {
+        const ImageView::Channel& ch = dst.channels[di];
+        auto it = std::find_if(file_image.channels.begin(), file_image.channels.end(), [&](const Image::Channel& fch) { return fch.name == ch.name; });
+        if (it == file_image.channels.end() || it->fp16 != ch.fp16)
+        {
+            printf("MOP file does not have %s channel %s\n", ch.fp16 ? "fp16" : "fp32", ch.name.c_str());
+            return false;
+        }
+        const size_t fi = it - file_image.channels.begin();
+        size_t gi = 0;
+        while (fi >= header.groups[gi].first_channel + header.groups[gi].channel_count)
+            ++gi;
+        MopGroupLoad& load = group_loads[gi];
+        load.group = &header.groups[gi];
+        const size_t src_offset = it->offset - load.group->image_offset;
+        if (dest.data != nullptr)
+            load.spans.push_back({src_offset, size_t(ch.base - dest.data), size_t(ch.fp16 ? 2 : 4)});
+        else
+            load.view_channels.push_back({src_offset, di});
+    }
+
+    std::vector<MopGroupLoad> loads;
+    for (MopGroupLoad& load : group_loads)
+    {
+        if (load.group == nullptr)
+            continue;
+        // merge spans that are contiguous in both source and destination
+        std::sort(load.spans.begin(), load.spans.end(), [](const CopySpan& a, const CopySpan& b) { return a.src_offset < b.src_offset; });
+        std::vector<CopySpan> spans;
+        for (const CopySpan& span : load.spans)
+        {
+            if (!spans.empty() && spans.back().src_offset + spans.back().size == span.src_offset && spans.back().dst_offset + spans.back().size == span.dst_offset)
+                spans.back().size += span.size;
+            else
+                spans.push_back(span);
+        }
+        load.spans.swap(spans);
+        loads.emplace_back(std::move(load));
+    }
+    return DecodeMopChunks(mem, header, loads, dest);
+}
+
+bool LoadMopRegion(MyIStream& mem, size_t x0, size_t y0, size_t w, size_t h, Image& r_image, const std::vector<std::string>& channels)
+{
+    TRACE_SCOPE("LoadMopRegion");
+    MopHeader header;
+    if (!ReadMopHeader(mem, r_image, header))
+        return false;
+    const size_t width = r_image.width;
+    if (w < 1 || h < 1 || x0 > width || w > width - x0 || y0 > r_image.height || h > r_image.height - y0)
+        return false;
+    size_t pixel_stride = 0;
+    std::vector<MopGroupLoad> loads;
+    if (!SelectMopChannels(header, channels, r_image, pixel_stride, loads))
+        return false;
+
+    // find which chunks intersect the region
+    std::vector<size_t> chunks;
+    if (header.tile_size != 0)
+    {
+        const size_t ts = header.tile_size;
+        for (size_t ty = y0 / ts; ty <= (y0 + h - 1) / ts; ++ty)
+        {
+            for (size_t tx = x0 / ts; tx <= (x0 + w - 1) / ts; ++tx)
+                chunks.push_back(ty * header.tiles_x + tx);
+        }
+    }
+    else
+    {
+        // each region row covers a contiguous range of chunks
+        std::vector<uint8_t> chunk_needed(header.chunk_count);
+        for (size_t y = y0; y < y0 + h; ++y)
+        {
+            const size_t first = (y * width + x0) / kChunkSize;
+            const size_t last = (y * width + x0 + w - 1) / kChunkSize;
+            for (size_t ci = first; ci <= last; ++ci)
+                chunk_needed[ci] = 1;
+        }
+        for (size_t ci = 0; ci < header.chunk_count; ++ci)
+        {
+            if (chunk_needed[ci])
+                chunks.push_back(ci);
+        }
+    }
+
+    r_image.width = w;
+    r_image.height = h;
+    r_image.pixels_size = w * h * pixel_stride;
+    r_image.pixels = MakePixelBuffer(r_image.pixels_size);
+
+    // chunks are decoded into a per-thread buffer, and then the parts
+    // that overlap the region are copied into destination
+    std::atomic<bool> ok(true);
+    ic::pfor(unsigned(loads.size() * chunks.size()), 0, [&](int job_index, int thread_index) {
+        MopThreadState& ts = s_mop_threads[thread_index];
+        const MopGroupLoad& load = loads[job_index / chunks.size()];
+        const MopGroup& group = *load.group;
+        const size_t chunk_index = chunks[job_index % chunks.size()];
+        const size_t coded_stride = group.coded_stride;
+        char* chunk_data = ts.pixels.get(group.chunk_buffer_size);
+        if (!DecodeMopChunk(mem, header, group, chunk_index, chunk_data, ts))
+        {
+            ok = false;
+            return;
+        }
+        if (header.tile_size != 0)
+        {
+            const TileRect tile = GetTileRect(header, chunk_index);
+            const size_t ix0 = std::max(x0, tile.x), ix1 = std::min(x0 + w, tile.x + tile.w);
+            const size_t iy0 = std::max(y0, tile.y), iy1 = std::min(y0 + h, tile.y + tile.h);
+            for (size_t y = iy0; y < iy1; ++y)
+            {
+                const char* src = chunk_data + ((y - tile.y) * tile.w + (ix0 - tile.x)) * coded_stride;
+                char* dst = r_image.pixels.get() + ((y - y0) * w + (ix0 - x0)) * pixel_stride;
+                CopyPixelSpans(dst, pixel_stride, src, coded_stride, load.spans, ix1 - ix0);
+            }
+            return;
+        }
+
+        const size_t chunk_start = chunk_index * kChunkSize;
+        const size_t chunk_end = chunk_start + GetChunkPixelCount(header, chunk_index);
+        const size_t row_start = std::max(y0, chunk_start / width);
+        const size_t row_end = std::min(y0 + h, (chunk_end - 1) / width + 1);
+        for (size_t y = row_start; y < row_end; ++y)
+        {
+            const size_t span_start = std::max(y * width + x0, chunk_start);
+            const size_t span_end = std::min(y * width + x0 + w, chunk_end);
+            if (span_start >= span_end)
+                continue;
+            const char* src = chunk_data + (span_start - chunk_start) * coded_stride;
+            char* dst = r_image.pixels.get() + ((y - y0) * w + (span_start - y * width - x0)) * pixel_stride;
+            CopyPixelSpans(dst, pixel_stride, src, coded_stride, load.spans, span_end - span_start);
         }
         });
 
     return ok;
 }
 
-bool SaveMopFile(MyOStream &mem, const Image& image, int cmp_level)
+// Where the encoder reads a channel group's pixels from. If the group's channels are adjacent
+// within source pixels and have the same strides, they are read as one span.
+struct MopGroupSource
+{
+    const char* data = nullptr; // first channel of the group; null if channels are read one by one
+    size_t x_stride = 0;
+    size_t y_stride = 0;
+};
+
+static MopGroupSource GetMopGroupSource(const ImageView& image, const MopGroup& group)
+{
+    MopGroupSource src;
+    const ImageView::Channel* channels = image.channels.data() + group.first_channel;
+    size_t offset = 0;
+    for (size_t i = 0; i < group.channel_count; ++i)
+    {
+        const ImageView::Channel& ch = channels[i];
+        if (ch.base != channels[0].base + offset || ch.x_stride != channels[0].x_stride || ch.y_stride != channels[0].y_stride)
+            return src;
+        offset += ch.fp16 ? 2 : 4;
+    }
+    if (channels[0].x_stride < offset)
+        return src;
+    src.data = channels[0].base;
+    src.x_stride = channels[0].x_stride;
+    src.y_stride = channels[0].y_stride;
+    return src;
+}
+
+// Copies count group pixels of source row y starting at x into dst, padded to coded_stride
+static void ReadGroupPixels(char* dst, const ImageView& image, const MopGroup& group, const MopGroupSource& src, size_t x, size_t y, size_t count)
+{
+    if (src.data != nullptr)
+    {
+        PadPixels(dst, group.coded_stride, src.data + x * src.x_stride + y * src.y_stride, src.x_stride, group.pixel_stride, count);
+        return;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < group.channel_count; ++i)
+    {
+        const ImageView::Channel& ch = image.channels[group.first_channel + i];
+        const size_t size = ch.fp16 ? 2 : 4;
+        CopyPixels(dst + offset, group.coded_stride, ch.at(x, y), ch.x_stride, size, count);
+        offset += size;
+    }
+    if (group.coded_stride != group.pixel_stride)
+    {
+        for (size_t i = 0; i < count; ++i)
+            memset(dst + i * group.coded_stride + group.pixel_stride, 0, group.coded_stride - group.pixel_stride);
+    }
+}
+
+// Encodes one chunk of a channel group into dst buffer (which is grown as needed), returns encoded size.
+// Picks the smallest of constant, raw, mesh optimizer or mesh optimizer+zstd encodings.
+static size_t EncodeMopChunk(const ImageView& image, const MopHeader& header, const MopGroup& group, const MopGroupSource& src, size_t index, int mop_level, int zstd_level, ScratchBuffer& dst, MopThreadState& ts)
 {
-    const bool zstd = cmp_level >= 1<<8;
+    TRACE_SCOPE("EncodeMopChunk");
+    const size_t pixel_stride = group.pixel_stride;
+    const size_t coded_stride = group.coded_stride;
+    const size_t chunk_pixel_count = GetChunkPixelCount(header, index);
+    // scanline order chunks can be read linearly if source rows are right after each other
+    const bool linear = src.data != nullptr && src.y_stride == src.x_stride * header.width;
+    const char* src_data = nullptr;
+    if (header.tile_size != 0)
+    {
+        char* tile_data = ts.padded.get(group.chunk_buffer_size);
+        const TileRect tile = GetTileRect(header, index);
+        for (size_t y = 0; y < tile.h; ++y)
+            ReadGroupPixels(tile_data + y * tile.w * coded_stride, image, group, src, tile.x, tile.y + y, tile.w);
+        src_data = tile_data;
+    }
+    else if (linear && IsChunkSameAsImage(header, group, chunk_pixel_count, src.x_stride) && header.filter == kFilterNone)
+    {
+        // can use source image data directly
+        src_data = src.data + index * kChunkSize * src.x_stride;
+    }
+    else if (linear)
+    {
+        char* padded_data = ts.padded.get(group.chunk_buffer_size);
+        PadPixels(padded_data, coded_stride, src.data + index * kChunkSize * src.x_stride, src.x_stride, pixel_stride, chunk_pixel_count);
+        src_data = padded_data;
+    }
+    else
+    {
+        // gather source rows that the chunk covers
+        char* padded_data = ts.padded.get(group.chunk_buffer_size);
+        size_t pos = index * kChunkSize;
+        for (size_t i = 0; i < chunk_pixel_count; )
+        {
+            const size_t x = pos % header.width, y = pos / header.width;
+            const size_t count = std::min(chunk_pixel_count - i, header.width - x);
+            ReadGroupPixels(padded_data + i * coded_stride, image, group, src, x, y, count);
+            i += count;
+            pos += count;
+        }
+        src_data = padded_data;
+    }
+
+    // odd pixel count with paired pixels: data is in padded buffer, add zero pixel
+    const size_t vertex_count = GetChunkVertexCount(group, chunk_pixel_count);
+    if (vertex_count * group.vertex_size != chunk_pixel_count * coded_stride)
+        memset(ts.padded.data.get() + chunk_pixel_count * coded_stride, 0, coded_stride);
+
+    // all pixels the same as the first one? (overlapping compare, shifted by one pixel)
+    if (memcmp(src_data + coded_stride, src_data, (chunk_pixel_count - 1) * coded_stride) == 0)
+    {
+        char* out = dst.get(1 + pixel_stride);
+        out[0] = kChunkConstant;
+        memcpy(out + 1, src_data, pixel_stride);
+        return 1 + pixel_stride;
+    }
+
+    if (header.filter != kFilterNone)
+        ApplyMopFilter(ts.padded.data.get(), chunk_pixel_count, header, group, false, ts); // filtered data is always in padded buffer
+
+    // mesh optimizer: directly into destination if not doing zstd
+    const size_t raw_size = chunk_pixel_count * coded_stride;
+    const size_t bufSize = meshopt_encodeVertexBufferBound(vertex_count, group.vertex_size);
+    const size_t z_bound = zstd_level != 0 ? ZSTD_compressBound(bufSize) : 0;
+    char* out = dst.get(1 + std::max(std::max(raw_size, bufSize), z_bound));
+    uint8_t* buf = zstd_level != 0 ? (uint8_t*)ts.encoded.get(bufSize) : (uint8_t*)out + 1;
+    size_t enc_size = meshopt_encodeVertexBufferLevel(
+        buf, bufSize,
+        src_data, vertex_count, group.vertex_size,
+        mop_level, 1);
+    MopChunkMode mode = kChunkMeshopt;
+
+    if (zstd_level != 0)
+    {
+        if (ts.cctx == nullptr)
+            ts.cctx = ZSTD_createCCtx();
+        const size_t z_size = ZSTD_compressCCtx(ts.cctx, out + 1, z_bound, buf, enc_size, zstd_level);
+        if (!ZSTD_isError(z_size) && z_size < enc_size)
+        {
+            enc_size = z_size;
+            mode = kChunkMeshoptZstd;
+        }
+        else
+        {
+            memcpy(out + 1, buf, enc_size);
+        }
+    }
+
+    // did not compress at all?
+    if (enc_size == 0 || enc_size >= raw_size)
+    {
+        memcpy(out + 1, src_data, raw_size);
+        enc_size = raw_size;
+        mode = kChunkRaw;
+    }
+    out[0] = mode;
+    return 1 + enc_size;
+}
+
+bool SaveMopFile(MyOStream &mem, const ImageView& image, int cmp_level)
+{
+    TRACE_SCOPE("SaveMopFile");
+    // file channel layout: view channels in order, packed
+    std::vector<Image::Channel> channels;
+    size_t offset = 0;
+    for (const ImageView::Channel& ch : image.channels)
+    {
+        channels.push_back({ch.name, ch.fp16, offset});
+        offset += ch.fp16 ? 2 : 4;
+    }
+
+    const int zstd_level = (cmp_level >> 8) & 0xFF;
+    const bool zstd = zstd_level != 0;
     const int mop_level = cmp_level & 0xFF;
+
+    MopHeader header;
+    header.zstd = zstd;
+    header.width = image.width;
+    header.height = image.height;
+    header.tile_size = (cmp_level & kMopTiled) ? kTileSize : 0;
+    header.filter = (cmp_level >> kMopFilterShift) & 3;
+    header.pair_pixels = (cmp_level & kMopPairPixels) != 0;
+    header.channel_groups = (cmp_level & kMopChannelGroups) != 0;
+    SplitMopChannelGroups(header, channels);
+    SetupMopChunks(header, channels);
+    bool any_paired = false;
+    std::vector<MopGroupSource> sources;
+    for (MopGroup& group : header.groups)
+    {
+        SetupMopFilter(header, group, channels);
+        any_paired |= group.paired;
+        sources.push_back(GetMopGroupSource(image, group));
+    }
+
+    // all chunks of first group, then all chunks of second group etc.
+    const size_t chunk_count = header.chunk_count;
+    const size_t job_count = chunk_count * header.groups.size();
+
+    // each chunk is at most mode byte + raw coded pixel data; reserve output space for that
+    // before writing anything, so that growing the output never copies what is already
+    // written. Not in streaming mode, where output grows as chunks get written.
+    if (!(cmp_level & kMopStreaming))
+    {
+        size_t max_size = mem.tellp() + 5 * sizeof(int32_t) + job_count * sizeof(size_t);
+        for (const Image::Channel& ch : channels)
+            max_size += 2 * sizeof(int32_t) + ch.name.size();
+        if (header.channel_groups)
+            max_size += (1 + header.groups.size()) * sizeof(int32_t);
+        if (header.tile_size != 0)
+            max_size += sizeof(int32_t);
+        for (const MopGroup& group : header.groups)
+            max_size += chunk_count + header.pixel_count * group.coded_stride;
+        mem.reserve(max_size);
+    }
+
     // header
     {
         const char magic[] = {'M', 'O', 'P', 'F'};
@@ -166,12 +1213,22 @@ bool SaveMopFile(MyOStream &mem, const Image& image, int cmp_level)
         int32_t chCount = int32_t(image.channels.size());
         int32_t flags = 0;
         if (zstd)
-            flags |= 1;
+            flags |= kFlagZstd;
+        if (header.tile_size != 0)
+            flags |= kFlagTiled;
+        flags |= header.filter << kFlagFilterShift;
+        flags |= kFlagChunkModes;
+        if (any_paired)
+            flags |= kFlagPairedPixels;
+        if (header.channel_groups)
+            flags |= kFlagChannelGroups;
         mem.write(width);
         mem.write(height);
         mem.write(flags);
+        if (header.tile_size != 0)
+            mem.write(int32_t(header.tile_size));
         mem.write(chCount);
-        for (const Image::Channel& ch : image.channels)
+        for (const Image::Channel& ch : channels)
         {
             int32_t type = ch.fp16 ? 0 : 1;
             int32_t nameLen = int32_t(ch.name.size());
@@ -179,74 +1236,120 @@ bool SaveMopFile(MyOStream &mem, const Image& image, int cmp_level)
             mem.write(nameLen);
             mem.write(ch.name.c_str(), int(ch.name.size()));
         }
+        if (header.channel_groups)
+        {
+            mem.write(int32_t(header.groups.size()));
+            for (const MopGroup& group : header.groups)
+                mem.write(int32_t(group.channel_count));
+        }
     }
 
-    const size_t pixel_count = image.width * image.height;
-    const size_t pixel_stride = image.pixels_size / pixel_count;
-    const size_t coded_stride = (pixel_stride + 3) / 4 * 4; // mesh optimizer requires stride to be multiple of 4
-    size_t chunk_count = (pixel_count + kChunkSize - 1) / kChunkSize;
-
-    std::vector<std::pair<uint8_t*, size_t>> encoded_chunks(chunk_count);
-
-    // if we need to add padding, reuse the padding buffers between work item invocations
-    std::unique_ptr<char[]> padded_buffer;
-    if (coded_stride != pixel_stride)
+    // chunk size table gets written after all the chunks are done
+    const uint64_t table_pos = mem.tellp();
+    std::vector<size_t> chunk_sizes(job_count);
+    for (size_t size : chunk_sizes)
     {
-        padded_buffer.reset(new char[s_mop_thread_count * kChunkSize * coded_stride]);
+        mem.write(size);
     }
 
-    ic::pfor(unsigned(chunk_count), 1, [&](int index, int thread_index) {
-        const size_t chunk_pixel_count = index == chunk_count - 1 ? pixel_count - index * kChunkSize : kChunkSize;
-        size_t bufSize = meshopt_encodeVertexBufferBound(chunk_pixel_count, coded_stride);
-        uint8_t* buf = new uint8_t[bufSize];
-        const char* src_data = image.pixels.get() + index * kChunkSize * pixel_stride;
-        size_t enc_size = 0;
-        if (pixel_stride == coded_stride)
+    // Chunks are encoded by worker tasks, each taking the next chunk in order until there are
+    // none left. Chunks are written out in order, each as soon as it and all the chunks before
+    // it are done, by whichever worker finishes a chunk when nobody else is writing. At most
+    // chunk_window chunks are encoded but not yet written, so only that many encoded chunks are
+    // held in memory at once. Workers do not wait for the window to move: a worker that would
+    // go past it stops, and the worker that moves the window along starts new ones, so pool
+    // threads are never blocked outside of the scheduler.
+    const size_t thread_count = size_t(std::max(s_mop_thread_count, 1));
+    const size_t chunk_window = std::min(job_count, thread_count * 4);
+    // output buffers, by job index modulo window size; reused once their chunk is written
+    std::vector<std::pair<ScratchBuffer, size_t>> encoded_chunks(chunk_window);
+    std::vector<uint8_t> chunk_done(job_count);
+    size_t next_job = 0; // next chunk to encode
+    size_t written_count = 0; // chunks written so far
+    size_t worker_count = 0; // running worker tasks
+    bool writing = false; // is some worker writing chunks out
+    std::mutex mutex;
+    ic::TaskGroup workers;
+    std::function<void(int)> run_worker;
+    // counts in the worker tasks to start for chunks within the window, up to thread count;
+    // called with mutex held, the tasks are started after unlocking
+    auto add_workers = [&]() -> size_t {
+        size_t available = std::min(job_count, written_count + chunk_window) - next_job;
+        size_t added = 0;
+        while (worker_count < thread_count && available-- > 0)
         {
-            enc_size = meshopt_encodeVertexBufferLevel(
-                buf, bufSize,
-                src_data, chunk_pixel_count, coded_stride,
-                mop_level, 1);
+            ++worker_count;
+            ++added;
         }
-        else
+        return added;
+    };
+    auto start_workers = [&](size_t count) {
+        for (size_t i = 0; i < count; ++i)
+            workers.spawn([&run_worker](int thread_index) { run_worker(thread_index); });
+    };
+    run_worker = [&](int thread_index) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (next_job < job_count && next_job < written_count + chunk_window)
         {
-            char* padded_data = padded_buffer.get() + kChunkSize * coded_stride * thread_index;
-            const char* src = src_data;
-            char* dst = padded_data;
-            for (size_t i = 0; i < chunk_pixel_count; ++i)
+            const size_t job_index = next_job++;
+            lock.unlock();
+            const size_t group_index = job_index / chunk_count;
+            std::pair<ScratchBuffer, size_t>& chunk = encoded_chunks[job_index % chunk_window];
+            chunk.second = EncodeMopChunk(image, header, header.groups[group_index], sources[group_index], job_index % chunk_count, mop_level, zstd_level, chunk.first, s_mop_threads[thread_index]);
+
+            // write out the done chunks that follow the written ones; one worker at a time, and
+            // without holding the lock while writing, so that others can mark theirs done
+            lock.lock();
+            chunk_done[job_index] = 1;
+            if (writing)
+                continue;
+            writing = true;
+            while (written_count < job_count && chunk_done[written_count])
             {
-                memcpy(dst, src, pixel_stride);
-                src += pixel_stride;
-                memset(dst + pixel_stride, 0, coded_stride - pixel_stride);
-                dst += coded_stride;
+                const std::pair<ScratchBuffer, size_t>& done = encoded_chunks[written_count % chunk_window];
+                lock.unlock();
+                mem.write(done.first.data.get(), int(done.second));
+                lock.lock();
+                chunk_sizes[written_count] = done.second;
+                ++written_count;
+            }
+            writing = false;
+            // the window moved: restart workers that stopped at its end
+            const size_t added = add_workers();
+            if (added != 0)
+            {
+                lock.unlock();
+                start_workers(added);
+                lock.lock();
             }
-            enc_size = meshopt_encodeVertexBufferLevel(
-                buf, bufSize,
-                padded_data, chunk_pixel_count, coded_stride,
-                mop_level, 1);
-        }
-        
-        if (zstd)
-        {
-            const size_t z_bound = ZSTD_compressBound(enc_size);
-            uint8_t* z_buf = new uint8_t[z_bound];
-            const int z_level = cmp_level >> 8;
-            const size_t z_size = ZSTD_compress(z_buf, z_bound, buf, enc_size, z_level);
-            delete[] buf;
-            buf = z_buf;
-            enc_size = z_size;
         }
-        encoded_chunks[index] = { buf, enc_size };
-        });
-
-    for (std::pair<uint8_t*, size_t>& chunk : encoded_chunks)
+        --worker_count;
+    };
     {
-        mem.write(chunk.second);
+        std::unique_lock<std::mutex> lock(mutex);
+        const size_t added = add_workers();
+        lock.unlock();
+        start_workers(added);
     }
-    for (std::pair<uint8_t*, size_t>& chunk : encoded_chunks)
+    workers.wait();
+
+    // go back and fill in the chunk size table
+    const uint64_t end_pos = mem.tellp();
+    mem.seekp(table_pos);
+    for (size_t size : chunk_sizes)
     {
-        mem.write((const char*)chunk.first, int(chunk.second));
-        delete[] chunk.first;
+        mem.write(size);
     }
+    mem.seekp(end_pos);
     return true;
 }
+
+std::future<bool> SaveMopFileAsync(MyOStream& mem, const Image& image, int cmp_level)
+{
+    return RunAsync([&mem, &image, cmp_level]() { return SaveMopFile(mem, image, cmp_level); });
+}
+
+std::future<bool> LoadMopFileAsync(MyIStream& mem, Image& r_image, const std::vector<std::string>& channels)
+{
+    return RunAsync([&mem, &r_image, channels]() { return LoadMopFile(mem, r_image, channels); });
+}
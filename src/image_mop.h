@@ -2,12 +2,36 @@
 
 #include "image.h"
 #include "fileio.h"
+#include <future>
 
 #ifdef INCLUDE_FORMAT_MOP
 
-void InitMop(int thread_count);
+// SaveMopFile cmp_level: mesh optimizer level in bits 0..7, zstd level (0=no zstd)
+// in bits 8..15, plus optional flags below.
+constexpr int kMopTiled = 1 << 16; // 128x128 pixel tiles instead of scanline-order chunks
+constexpr int kMopStreaming = 1 << 17; // do not reserve worst-case output size up front; output grows as chunks get written
+// Reversible pixel data filter before mesh optimizer, in bits 18..19:
+constexpr int kMopFilterShift = 18;
+constexpr int kMopFilterSignRemap = 1 << kMopFilterShift; // flip bits of negative values, making them ordered like integers
+constexpr int kMopFilterXorLeft = 2 << kMopFilterShift; // XOR each pixel with the previous one
+constexpr int kMopFilterBytePlanes = 3 << kMopFilterShift; // group bytes by significance (exponent/mantissa) within each pixel
+constexpr int kMopPairPixels = 1 << 20; // if pixel size is not a multiple of 4, encode pixel pairs instead of padding each pixel
+constexpr int kMopChannelGroups = 1 << 21; // compress each layer's channels separately, so they can be loaded independently
+
+void InitMop();
 void ShutdownMop();
-bool SaveMopFile(MyOStream& mem, const Image& image, int cmp_level);
-bool LoadMopFile(MyIStream& mem, Image& r_image);
+bool SaveMopFile(MyOStream& mem, const ImageView& image, int cmp_level);
+// Loads only the given channels (in file order) if the list is not empty. With
+// channel groups, only the groups containing these channels are decoded.
+bool LoadMopFile(MyIStream& mem, Image& r_image, const std::vector<std::string>& channels = {});
+// Loads the view's channels directly into its memory; file size and channel types must match.
+bool LoadMopFile(MyIStream& mem, const ImageView& dst);
+// Decodes only the chunks needed for the given pixel rectangle; r_image gets
+// the size of the rectangle.
+bool LoadMopRegion(MyIStream& mem, size_t x0, size_t y0, size_t w, size_t h, Image& r_image, const std::vector<std::string>& channels = {});
+
+// Same as above, but run on the shared thread pool; arguments have to stay alive until the future is ready.
+std::future<bool> SaveMopFileAsync(MyOStream& mem, const Image& image, int cmp_level);
+std::future<bool> LoadMopFileAsync(MyIStream& mem, Image& r_image, const std::vector<std::string>& channels = {});
 
 #endif
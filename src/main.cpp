@@ -7,8 +7,11 @@
 
 #include <thread>
 #include "systeminfo.h"
+#include "threading.h"
+#include "trace.h"
 #include "fileio.h"
 #include "image.h"
+#include "pixelalloc.h"
 #include "image_exr.h"
 #include "image_jxl.h"
 #include "image_mop.h"
@@ -98,6 +101,16 @@ static const CompressorDesc kTestCompr[] =
     { 8, 2 | (3<<8) }, // mop 2, zstd 3
     { 8, 2 | (10<<8) }, // mop 2, zstd 10
     { 8, 3 | (20<<8) }, // mop 3, zstd 20
+    // 2D tiles
+    { 8, 2 | (3<<8) | kMopTiled }, // mop 2, zstd 3, tiled
+    // pixel data filters
+    { 8, 2 | (3<<8) | kMopFilterSignRemap },
+    { 8, 2 | (3<<8) | kMopFilterXorLeft },
+    { 8, 2 | (3<<8) | kMopFilterBytePlanes },
+    // two pixels per "vertex" when pixel size is not a multiple of 4
+    { 8, 2 | (3<<8) | kMopPairPixels },
+    // each layer compressed separately, for loading only some of the channels
+    { 8, 2 | (3<<8) | kMopChannelGroups },
 #endif
 };
 constexpr size_t kTestComprCount = sizeof(kTestCompr) / sizeof(kTestCompr[0]);
@@ -108,6 +121,8 @@ struct ComprResult
     size_t cmpSize = 0;
     double tRead = 0;
     double tWrite = 0;
+    double busyRead = 0; // thread pool busy time, summed over threads
+    double busyWrite = 0;
 };
 static ComprResult s_ResultRuns[kTestComprCount][kRunCount];
 static ComprResult s_Result[kTestComprCount];
@@ -118,11 +133,12 @@ static bool TestFile(const char* file_path, int run_index)
     if (fname_part == nullptr)
         fname_part = file_path;
     printf("%s: ", fname_part);
+    TRACE_SCOPE_ARG("TestFile", fname_part);
     
     // read the input file
     Image img_in;
     {
-        MyIStream mem_in(file_path);
+        MyIStream mem_in(file_path, true);
         if (!LoadExrFile(mem_in, img_in))
         {
             printf("ERROR: failed to load EXR file %s\n", file_path);
@@ -132,9 +148,12 @@ static bool TestFile(const char* file_path, int run_index)
     
     // Note: libjxl currently does not seem to round-trip fp16 subnormals
     // even in full lossless mode, see https://github.com/libjxl/libjxl/issues/3881
-    SanitizePixelValues(img_in);
+    const size_t sanitized = SanitizePixelValues(img_in);
 
-    printf("%ix%i, %i channels, %i bytes/pixel (%.1fMB)\n", int(img_in.width), int(img_in.height), int(img_in.channels.size()), int(img_in.pixels_size/img_in.width/img_in.height), img_in.pixels_size/1024.0/1024.0);
+    printf("%ix%i, %i channels, %i bytes/pixel (%.1fMB)", int(img_in.width), int(img_in.height), int(img_in.channels.size()), int(img_in.pixels_size/img_in.width/img_in.height), img_in.pixels_size/1024.0/1024.0);
+    if (sanitized != 0)
+        printf(", %zi fp16 subnormals set to zero", sanitized);
+    printf("\n");
     const size_t raw_size = img_in.pixels_size;
     
     // test various compression schemes
@@ -146,8 +165,10 @@ static bool TestFile(const char* file_path, int run_index)
         double t_read = 0;
 
         // save the file with given compressor
+        ResetThreadingStats();
         auto t_write_0 = time_now();
-        MyOStream mem_out;
+        // compressed output rarely gets larger than raw pixel data; a bit of extra space for headers
+        MyOStream mem_out(img_in.pixels_size + 64 * 1024);
         if (cmp_type == CompressorType::Raw)
         {
             mem_out.write(img_in.pixels.get(), (int)img_in.pixels_size);
@@ -181,17 +202,19 @@ static bool TestFile(const char* file_path, int run_index)
             }
         }
         t_write = time_duration_ms(t_write_0) / 1000.0f;
+        const double busy_write = GetThreadingStats().busy_time;
         size_t out_size = mem_out.size();
         
         // read the file back
         Image img_got;
+        ResetThreadingStats();
         auto t_read_0 = time_now();
         MyIStream mem_got_in(mem_out.data(), mem_out.size());
         if (cmp_type == CompressorType::Raw)
         {
             img_got.width = img_in.width;
             img_got.height = img_in.height;
-            img_got.pixels = std::unique_ptr<char[]>(new char[img_in.pixels_size]);
+            img_got.pixels = MakePixelBuffer(img_in.pixels_size);
             img_got.pixels_size = img_in.pixels_size;
             memcpy(img_got.pixels.get(), mem_got_in.data(), img_got.pixels_size);
         }
@@ -224,6 +247,7 @@ static bool TestFile(const char* file_path, int run_index)
             }
         }
         t_read = time_duration_ms(t_read_0) / 1000.0f;
+        const double busy_read = GetThreadingStats().busy_time;
         if (!CompareImages(img_in, img_got))
         {
             printf("ERROR: file did not roundtrip exactly with compression %s\n", kComprTypes[cmp.type].name);
@@ -236,6 +260,8 @@ static bool TestFile(const char* file_path, int run_index)
         res.cmpSize += out_size;
         res.tRead += t_read;
         res.tWrite += t_write;
+        res.busyRead += busy_read;
+        res.busyWrite += busy_write;
     }
     
     return true;
@@ -254,9 +280,23 @@ static void WriteReportRow(FILE* fout, uint64_t gotTypeMask, size_t cmpIndex, do
         fprintf(fout, ",null,null");
     }
     fprintf(fout, ",%.2f,'", yval);
-    if (typeIndex == (int)CompressorType::Mop && cmpLevel >= 1<<8)
-        fprintf(fout, "%s%i/%i", cmpName, cmpLevel&0xFF, cmpLevel>>8);
-    else if (cmpLevel != 0 || typeIndex == (int)CompressorType::Mop)
+    if (typeIndex == (int)CompressorType::Mop)
+    {
+        fprintf(fout, "%s%i", cmpName, cmpLevel&0xFF);
+        if ((cmpLevel>>8)&0xFF)
+            fprintf(fout, "/%i", (cmpLevel>>8)&0xFF);
+#ifdef INCLUDE_FORMAT_MOP
+        if (cmpLevel & kMopTiled)
+            fprintf(fout, "t");
+        if ((cmpLevel >> kMopFilterShift) & 3)
+            fprintf(fout, "f%i", (cmpLevel >> kMopFilterShift) & 3);
+        if (cmpLevel & kMopPairPixels)
+            fprintf(fout, "p");
+        if (cmpLevel & kMopChannelGroups)
+            fprintf(fout, "g");
+#endif
+    }
+    else if (cmpLevel != 0)
         fprintf(fout, "%s%i", cmpName, cmpLevel);
     else
         fprintf(fout, "%s", cmpName);
@@ -389,29 +429,53 @@ chr.draw(dr, options);
 
 int main(int argc, const char** argv)
 {
-    if (argc < 2) {
-        printf("USAGE: test_exr_htj2k_jxl <input exr files>\n");
+    // thread count: physical cores available to the process, unless
+    // overridden by TEST_EXR_THREADS environment variable or --threads=N
+    unsigned nThreads = sysinfo_getavailablecores();
+    if (const char* envThreads = getenv("TEST_EXR_THREADS"))
+    {
+        if (atoi(envThreads) > 0)
+            nThreads = atoi(envThreads);
+    }
+    bool pinThreads = false;
+    std::vector<const char*> files;
+    for (int ai = 1; ai < argc; ++ai)
+    {
+        if (strcmp(argv[ai], "--pin-threads") == 0)
+            pinThreads = true;
+        else if (strcmp(argv[ai], "--huge-pages") == 0)
+            SetPixelHugePages(true);
+        else if (strncmp(argv[ai], "--threads=", 10) == 0)
+        {
+            if (atoi(argv[ai] + 10) > 0)
+                nThreads = atoi(argv[ai] + 10);
+        }
+        else
+            files.push_back(argv[ai]);
+    }
+    if (files.empty()) {
+        printf("USAGE: test_exr_htj2k_jxl [--threads=N] [--pin-threads] [--huge-pages] <input exr files>\n");
         return 1;
     }
-    unsigned nThreads = sysinfo_getcpuphysicalcores();
 //#ifdef _DEBUG
 //    nThreads = 0;
 //#endif
-    printf("Setting EXR/JXL to %i threads\n", nThreads);
-    InitExr(nThreads);
+    printf("Setting thread pool to %i threads%s\n", nThreads, pinThreads ? ", pinned to CPUs" : "");
+    nThreads = InitThreading(nThreads, pinThreads);
+    InitExr();
 #ifdef INCLUDE_FORMAT_JXL
-    InitJxl(nThreads);
+    InitJxl();
 #endif
 #ifdef INCLUDE_FORMAT_MOP
-    InitMop(nThreads);
+    InitMop();
 #endif
 
     for (int ri = 0; ri < kRunCount; ++ri)
     {
         printf("Run %i/%i...\n", ri+1, kRunCount);
-        for (int fi = 1; fi < argc; ++fi)
+        for (const char* file : files)
         {
-            bool ok = TestFile(argv[fi], ri);
+            bool ok = TestFile(file, ri);
             if (!ok)
                 return 1;
         }
@@ -436,14 +500,22 @@ int main(int argc, const char** argv)
                     printf("ERROR: compressor case %i non deterministic raw size (%zi vs %zi)\n", ci, res.rawSize, dst.rawSize);
                     return 1;
                 }
-                if (res.tRead < dst.tRead) dst.tRead = res.tRead;
-                if (res.tWrite < dst.tWrite) dst.tWrite = res.tWrite;
+                if (res.tRead < dst.tRead)
+                {
+                    dst.tRead = res.tRead;
+                    dst.busyRead = res.busyRead;
+                }
+                if (res.tWrite < dst.tWrite)
+                {
+                    dst.tWrite = res.tWrite;
+                    dst.busyWrite = res.busyWrite;
+                }
             }
         }
     }
 
-    WriteReportFile(nThreads, argc-1, s_Result[0].rawSize);
-    printf("==== Summary (%i files, %i runs):\n", argc-1, kRunCount);
+    WriteReportFile(nThreads, int(files.size()), s_Result[0].rawSize);
+    printf("==== Summary (%i files, %i runs):\n", int(files.size()), kRunCount);
     for (size_t cmpIndex = 0; cmpIndex < kTestComprCount; ++cmpIndex)
     {
         const auto& cmp = kTestCompr[cmpIndex];
@@ -451,19 +523,31 @@ int main(int argc, const char** argv)
 
         double perfWrite = res.rawSize / (1024.0*1024.0*1024.0) / res.tWrite;
         double perfRead = res.rawSize / (1024.0*1024.0*1024.0) / res.tRead;
-        printf("  %6s: %7.1f MB (%5.3fx) W: %6.3f s (%6.3f GB/s) R: %6.3f s (%6.3f GB/s)\n",
+        // parallel efficiency: how much of the time all the pool threads were running tasks
+        double effWrite = res.busyWrite / (res.tWrite * nThreads);
+        double effRead = res.busyRead / (res.tRead * nThreads);
+        printf("  %6s: %7.1f MB (%5.3fx) W: %6.3f s (%6.3f GB/s, %3.0f%% eff) R: %6.3f s (%6.3f GB/s, %3.0f%% eff)\n",
                kComprTypes[cmp.type].name,
                res.cmpSize/1024.0/1024.0,
                (double)res.rawSize/(double)res.cmpSize,
                res.tWrite,
                perfWrite,
+               effWrite * 100.0,
                res.tRead,
-               perfRead);
+               perfRead,
+               effRead * 100.0);
     }
+    const PixelPoolStats poolStats = GetPixelPoolStats();
+    printf("  Pixel buffers: %zi allocations, %zi reused from pool\n", poolStats.allocs, poolStats.reused);
 
 #ifdef INCLUDE_FORMAT_MOP
     ShutdownMop();
 #endif
+    ShutdownThreading();
+    TrimPixelPool();
+#ifdef ENABLE_TRACE
+    TraceWriteFile((sysinfo_getcurtime() + "-trace.json").c_str());
+#endif
 
     return 0;
 }
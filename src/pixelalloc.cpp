@@ -0,0 +1,229 @@
+#include "pixelalloc.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+#ifdef __linux
+#include <sys/mman.h>
+#endif
+
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+// Requests up to this size skip the pool: malloc already recycles small blocks
+// cheaply, and the pool mutex and map insert would cost more than they save.
+constexpr size_t kSmallPixelSize = 64 * 1024;
+// Pooled blocks are aligned to kPoolAlignment; small ones sit kPixelAlignment past
+// such a boundary, which is how FreePixels tells them apart without a lookup.
+constexpr size_t kPoolAlignment = kPixelAlignment * 2;
+// Default pool limit, as a multiple of the largest allocation so far
+constexpr size_t kAutoPoolLimitFactor = 4;
+
+struct PixelPool
+{
+    std::mutex mutex;
+    std::map<size_t, std::vector<char*>> free_lists; // by capacity
+    // Capacity of allocations that are in use. Kept on the side and not in a header
+    // before the data, so that data starts right at the (possibly huge page) alignment.
+    std::unordered_map<char*, size_t> capacities;
+    size_t pooled_size = 0;
+    size_t limit = 0; // 0: automatic, see GetPoolLimit
+    size_t largest = 0; // largest capacity allocated so far
+    bool huge_pages = false;
+    std::atomic<size_t> allocs{0};
+    size_t reused = 0;
+};
+
+// Never destroyed, since buffers might get freed from static destructors.
+static PixelPool& GetPool()
+{
+    static PixelPool* pool = new PixelPool();
+    return *pool;
+}
+
+// Pool limit; by default a few times the largest buffer, so that the pool holds about
+// as many images as a load/save cycle uses, and not more than that.
+static size_t GetPoolLimit(const PixelPool& pool)
+{
+    return pool.limit != 0 ? pool.limit : pool.largest * kAutoPoolLimitFactor;
+}
+
+// Rounds size up to its size class: multiples of 4KB up to 64KB, then four
+// classes per power of two, i.e. at most 25% of wasted space.
+static size_t GetSizeClass(size_t size)
+{
+    if (size <= 64 * 1024)
+        return size == 0 ? 4096 : (size + 4095) & ~size_t(4095);
+    size_t step = 64 * 1024 / 4;
+    while (step * 8 < size)
+        step *= 2;
+    return (size + step - 1) / step * step;
+}
+
+static char* SystemAlloc(size_t capacity, bool huge_pages)
+{
+    void* ptr = nullptr;
+#ifdef _MSC_VER
+    ptr = _aligned_malloc(capacity, kPoolAlignment);
+#else
+    if (posix_memalign(&ptr, huge_pages ? kHugePageSize : kPoolAlignment, capacity) != 0)
+        ptr = nullptr;
+#endif
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+#ifdef __linux
+    if (huge_pages)
+        madvise(ptr, capacity, MADV_HUGEPAGE);
+#endif
+    return (char*)ptr;
+}
+
+static void SystemFree(char* ptr)
+{
+#ifdef _MSC_VER
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+static bool IsSmallBlock(const char* ptr)
+{
+    return (uintptr_t(ptr) & (kPoolAlignment - 1)) == kPixelAlignment;
+}
+
+// Evicts pooled blocks, smallest classes first, until pooled_size is at most target.
+// Called with the pool mutex held; the blocks are freed by the caller after unlocking.
+static void EvictPooled(PixelPool& pool, size_t target, std::vector<char*>& evicted)
+{
+    for (auto it = pool.free_lists.begin(); it != pool.free_lists.end() && pool.pooled_size > target; ++it)
+    {
+        while (!it->second.empty() && pool.pooled_size > target)
+        {
+            evicted.push_back(it->second.back());
+            it->second.pop_back();
+            pool.pooled_size -= it->first;
+        }
+    }
+}
+
+char* AllocPixels(size_t size)
+{
+    PixelPool& pool = GetPool();
+    pool.allocs.fetch_add(1, std::memory_order_relaxed);
+    if (size <= kSmallPixelSize)
+        return SystemAlloc(size + kPixelAlignment, false) + kPixelAlignment;
+
+    const size_t capacity = GetSizeClass(size);
+    bool huge_pages = false;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.largest = std::max(pool.largest, capacity);
+        auto it = pool.free_lists.find(capacity);
+        if (it != pool.free_lists.end() && !it->second.empty())
+        {
+            char* ptr = it->second.back();
+            it->second.pop_back();
+            pool.pooled_size -= capacity;
+            ++pool.reused;
+            pool.capacities[ptr] = capacity;
+            return ptr;
+        }
+        huge_pages = pool.huge_pages && capacity >= kHugePageSize;
+    }
+    char* ptr = SystemAlloc(capacity, huge_pages);
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.capacities[ptr] = capacity;
+    return ptr;
+}
+
+void FreePixels(char* ptr)
+{
+    if (ptr == nullptr)
+        return;
+    if (IsSmallBlock(ptr))
+    {
+        SystemFree(ptr - kPixelAlignment);
+        return;
+    }
+    PixelPool& pool = GetPool();
+    std::vector<char*> evicted;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        auto live = pool.capacities.find(ptr);
+        assert(live != pool.capacities.end() && "FreePixels: not allocated by AllocPixels");
+        if (live == pool.capacities.end())
+            return;
+        const size_t capacity = live->second;
+        pool.capacities.erase(live);
+        const size_t limit = GetPoolLimit(pool);
+        if (capacity > limit)
+        {
+            evicted.push_back(ptr);
+        }
+        else
+        {
+            // make room by evicting other classes
+            EvictPooled(pool, limit - capacity, evicted);
+            pool.free_lists[capacity].push_back(ptr);
+            pool.pooled_size += capacity;
+        }
+    }
+    for (char* p : evicted)
+        SystemFree(p);
+}
+
+void SetPixelHugePages(bool enable)
+{
+    PixelPool& pool = GetPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.huge_pages = enable;
+}
+
+void SetPixelPoolLimit(size_t size)
+{
+    PixelPool& pool = GetPool();
+    std::vector<char*> evicted;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.limit = size;
+        EvictPooled(pool, GetPoolLimit(pool), evicted);
+    }
+    for (char* p : evicted)
+        SystemFree(p);
+}
+
+void TrimPixelPool()
+{
+    PixelPool& pool = GetPool();
+    std::map<size_t, std::vector<char*>> free_lists;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        free_lists.swap(pool.free_lists);
+        pool.pooled_size = 0;
+    }
+    for (const auto& list : free_lists)
+    {
+        for (char* ptr : list.second)
+            SystemFree(ptr);
+    }
+}
+
+PixelPoolStats GetPixelPoolStats()
+{
+    PixelPool& pool = GetPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    PixelPoolStats stats;
+    stats.allocs = pool.allocs.load(std::memory_order_relaxed);
+    stats.reused = pool.reused;
+    stats.pooled_size = pool.pooled_size;
+    return stats;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <memory>
+#include <stddef.h>
+
+// Allocator for large pixel buffers. Memory is kPixelAlignment aligned and not
+// initialized. Freed buffers are kept in a pool by size class, and reused by later
+// allocations of the same class; so e.g. decoding many same sized images does not
+// page fault fresh memory for each of them. Small buffers (64KB and below) are not
+// pooled and come straight from the system allocator.
+
+constexpr size_t kPixelAlignment = 64;
+
+char* AllocPixels(size_t size);
+void FreePixels(char* ptr);
+
+struct PixelDeleter
+{
+    void operator()(char* ptr) const { FreePixels(ptr); }
+};
+typedef std::unique_ptr<char[], PixelDeleter> PixelBuffer;
+
+inline PixelBuffer MakePixelBuffer(size_t size) { return PixelBuffer(AllocPixels(size)); }
+
+// Back new allocations of 2MB and larger with transparent huge pages (Linux only);
+// these start at a huge page boundary.
+void SetPixelHugePages(bool enable);
+// Upper limit of freed memory kept in the pool; anything above that is returned to the OS.
+// Zero (the default) means four times the largest buffer allocated so far.
+void SetPixelPoolLimit(size_t size);
+// Returns all pooled memory to the OS.
+void TrimPixelPool();
+
+struct PixelPoolStats
+{
+    size_t allocs = 0; // all allocations
+    size_t reused = 0; // allocations served from the pool
+    size_t pooled_size = 0; // memory currently kept in the pool
+};
+PixelPoolStats GetPixelPoolStats();
@@ -0,0 +1,17 @@
+#pragma once
+
+// SIMD instruction set used by pixel processing code: SSE2 on x64 (always
+// available there), NEON on ARM; code has to have a scalar fallback too.
+// SIMD_AVX2 is set in addition to SIMD_SSE2 when compiling for AVX2 (ENABLE_AVX2
+// in CMake); code can use it for a wider main loop, with SSE2 for the tail.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+#if SIMD_SSE2 && defined(__AVX2__)
+#define SIMD_AVX2 1
+#include <immintrin.h>
+#endif
@@ -1,6 +1,7 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include "systeminfo.h"
 
+#include <math.h>
 #include <time.h>
 #include <set>
 #include <thread>
@@ -14,6 +15,9 @@
 #ifdef __linux
 #include <string.h>
 #include <stdio.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdlib.h>
 #endif
 
 std::string sysinfo_getplatform()
@@ -89,6 +93,276 @@ unsigned int sysinfo_getcpuphysicalcores()
 }
 
 
+#ifdef __linux
+static bool read_file_line(const std::string& path, char* line, size_t size)
+{
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file)
+        return false;
+    const bool ok = fgets(line, int(size), file) != nullptr;
+    fclose(file);
+    return ok;
+}
+
+// CPU count allowed by cgroup quota (v2 cpu.max, or v1 CFS quota and period) of this
+// process and its parent groups; 0 if there is no limit.
+static double get_cgroup_cpu_limit()
+{
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    if (!file)
+        return 0;
+    double limit = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), file))
+    {
+        // "hierarchy-id:controller-list:path", controller list is empty for v2
+        char* controllers = strchr(line, ':');
+        if (!controllers)
+            continue;
+        ++controllers;
+        char* path = strchr(controllers, ':');
+        if (!path)
+            continue;
+        *path++ = 0;
+        path[strcspn(path, "\n")] = 0;
+        const bool v2 = controllers[0] == 0;
+        bool has_cpu = false;
+        for (char* name = strtok(controllers, ","); name; name = strtok(nullptr, ","))
+            has_cpu |= strcmp(name, "cpu") == 0;
+        if (!v2 && !has_cpu)
+            continue;
+
+        // the group path might not be visible inside a container, so also go up to the root
+        std::string dir = path;
+        while (true)
+        {
+            double quota = 0, period = 0;
+            char value[256];
+            if (v2)
+            {
+                char max[64] = {0};
+                if (read_file_line("/sys/fs/cgroup" + dir + "/cpu.max", value, sizeof(value)) && sscanf(value, "%63s %lf", max, &period) == 2 && strcmp(max, "max") != 0)
+                    quota = atof(max);
+            }
+            else
+            {
+                for (const char* base : {"/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu"})
+                {
+                    if (read_file_line(base + dir + "/cpu.cfs_quota_us", value, sizeof(value)))
+                    {
+                        quota = atof(value);
+                        if (read_file_line(base + dir + "/cpu.cfs_period_us", value, sizeof(value)))
+                            period = atof(value);
+                        break;
+                    }
+                }
+            }
+            if (quota > 0 && period > 0 && (limit == 0 || quota / period < limit))
+                limit = quota / period;
+            if (dir.empty() || dir == "/")
+                break;
+            dir.resize(dir.rfind('/'));
+        }
+    }
+    fclose(file);
+    return limit;
+}
+#endif
+
+unsigned int sysinfo_getavailablecores()
+{
+    unsigned int cores = sysinfo_getcpuphysicalcores();
+#if defined(_MSC_VER)
+    DWORD_PTR process_mask = 0, system_mask = 0;
+    if (::GetProcessAffinityMask(::GetCurrentProcess(), &process_mask, &system_mask) && process_mask != system_mask)
+    {
+        unsigned int allowed = 0;
+        for (; process_mask; process_mask &= process_mask - 1)
+            ++allowed;
+        if (allowed < cores)
+            cores = allowed;
+    }
+#elif defined __linux
+    // count unique physical cores among allowed CPUs, so that SMT siblings count once
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        std::set<std::pair<int, int>> core_set;
+        int unknown = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (!CPU_ISSET(cpu, &allowed))
+                continue;
+            char path[200], value[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/topology/", cpu);
+            if (read_file_line(std::string(path) + "physical_package_id", value, sizeof(value)))
+            {
+                const int package = atoi(value);
+                if (read_file_line(std::string(path) + "core_id", value, sizeof(value)))
+                {
+                    core_set.emplace(package, atoi(value));
+                    continue;
+                }
+            }
+            ++unknown;
+        }
+        const unsigned int allowed_cores = unsigned(core_set.size()) + unknown;
+        if (allowed_cores > 0 && (allowed_cores < cores || cores == 0))
+            cores = allowed_cores;
+    }
+    const double limit = get_cgroup_cpu_limit();
+    if (limit > 0 && limit < cores)
+        cores = unsigned(ceil(limit));
+#endif
+    return cores > 0 ? cores : 1;
+}
+
+#ifdef __linux
+// parses "0-3,8,10-11" style CPU lists
+static std::vector<int> parse_cpu_list(const char* list)
+{
+    std::vector<int> cpus;
+    while (*list)
+    {
+        char* end = nullptr;
+        int first = (int)strtol(list, &end, 10);
+        if (end == list)
+            break;
+        int last = first;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = (int)strtol(list, &end, 10);
+        }
+        for (int i = first; i <= last; ++i)
+            cpus.push_back(i);
+        list = end;
+        while (*list == ',' || *list == '\n')
+            ++list;
+    }
+    return cpus;
+}
+#endif
+
+std::vector<std::vector<int>> sysinfo_getnumanodes()
+{
+    std::vector<std::vector<int>> nodes;
+#if defined(_MSC_VER)
+    // logical CPU ids are processor group * 64 + index within the group
+    DWORD length = 0;
+    if (!::GetLogicalProcessorInformationEx(RelationNumaNode, nullptr, &length) && ::GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+    {
+        std::vector<uint8_t> buffer(length);
+        if (::GetLogicalProcessorInformationEx(RelationNumaNode, (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)buffer.data(), &length))
+        {
+            DWORD offset = 0;
+            while (offset < length)
+            {
+                SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buffer.data() + offset);
+                if (info->Relationship == RelationNumaNode)
+                {
+                    const GROUP_AFFINITY& mask = info->NumaNode.GroupMask;
+                    std::vector<int> cpus;
+                    for (int i = 0; i < 64; ++i)
+                    {
+                        if (mask.Mask & (KAFFINITY(1) << i))
+                            cpus.push_back(mask.Group * 64 + i);
+                    }
+                    if (!cpus.empty())
+                        nodes.push_back(cpus);
+                }
+                offset += info->Size;
+            }
+        }
+    }
+#elif defined __linux
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool has_allowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    if (DIR* dir = opendir("/sys/devices/system/node"))
+    {
+        while (dirent* entry = readdir(dir))
+        {
+            int node = -1;
+            if (sscanf(entry->d_name, "node%d", &node) != 1)
+                continue;
+            char path[300];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+            FILE* file = fopen(path, "r");
+            if (!file)
+                continue;
+            char line[4096] = {0};
+            if (fgets(line, sizeof(line), file))
+            {
+                std::vector<int> cpus;
+                for (int cpu : parse_cpu_list(line))
+                {
+                    if (!has_allowed || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+                        cpus.push_back(cpu);
+                }
+                if (!cpus.empty())
+                {
+                    if (nodes.size() <= size_t(node))
+                        nodes.resize(node + 1);
+                    nodes[node] = cpus;
+                }
+            }
+            fclose(file);
+        }
+        closedir(dir);
+    }
+    // node ids can have gaps
+    std::vector<std::vector<int>> used_nodes;
+    for (auto& cpus : nodes)
+    {
+        if (!cpus.empty())
+            used_nodes.push_back(std::move(cpus));
+    }
+    nodes.swap(used_nodes);
+    if (nodes.empty() && has_allowed)
+    {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+        }
+        if (!cpus.empty())
+            nodes.push_back(cpus);
+    }
+#endif
+    if (nodes.empty())
+    {
+        std::vector<int> cpus;
+        for (unsigned i = 0; i < std::thread::hardware_concurrency(); ++i)
+            cpus.push_back(int(i));
+        nodes.push_back(cpus);
+    }
+    return nodes;
+}
+
+bool sysinfo_pinthread(int cpu)
+{
+#if defined(_MSC_VER)
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = WORD(cpu / 64);
+    affinity.Mask = KAFFINITY(1) << (cpu % 64);
+    return ::SetThreadGroupAffinity(::GetCurrentThread(), &affinity, nullptr) != 0;
+#elif defined __linux
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    // macOS has no API to pin threads to CPUs
+    (void)cpu;
+    return false;
+#endif
+}
+
 std::string sysinfo_getcpumodel()
 {
     #ifdef __APPLE__
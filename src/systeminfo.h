@@ -1,8 +1,18 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 std::string sysinfo_getplatform();
 std::string sysinfo_getcpumodel();
 std::string sysinfo_getcurtime();
 unsigned int sysinfo_getcpuphysicalcores();
+// Physical CPU cores that this process can actually use: on Linux, only cores that are
+// in the affinity mask, further limited by cgroup CPU quota (e.g. in containers).
+unsigned int sysinfo_getavailablecores();
+
+// Logical CPU ids for each NUMA node (a single node on systems without NUMA),
+// only including CPUs that this process is allowed to run on.
+std::vector<std::vector<int>> sysinfo_getnumanodes();
+// Pins the calling thread to the given logical CPU id; returns false if not possible.
+bool sysinfo_pinthread(int cpu);
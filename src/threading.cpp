@@ -0,0 +1,86 @@
+#include "threading.h"
+#define IC_PFOR_IMPLEMENTATION
+#include "ic_pfor.h"
+#include "systeminfo.h"
+#include <vector>
+
+static int s_thread_count;
+static ic::TaskGroup s_async_tasks;
+static std::vector<int> s_thread_cpus; // CPU for each thread index when pinning
+
+static void PinPoolThread(void* /*context*/, int thread_idx)
+{
+    // index 0 is the calling thread, which is not pinned; its CPU is left free for it
+    sysinfo_pinthread(s_thread_cpus[thread_idx % s_thread_cpus.size()]);
+}
+
+int InitThreading(int thread_count, bool pin_threads)
+{
+    // take CPUs from each NUMA node in turn, so that threads are spread over all
+    // nodes; within a node CPUs are in id order, which usually has SMT siblings last
+    s_thread_cpus.clear();
+    if (pin_threads)
+    {
+        const std::vector<std::vector<int>> nodes = sysinfo_getnumanodes();
+        for (size_t i = 0, added = 1; added != 0; ++i)
+        {
+            added = 0;
+            for (const std::vector<int>& cpus : nodes)
+            {
+                if (i < cpus.size())
+                {
+                    s_thread_cpus.push_back(cpus[i]);
+                    ++added;
+                }
+            }
+        }
+    }
+    // pool threads touch their own scratch memory first (e.g. MOP per-thread buffers
+    // are allocated on first use), so with pinning it is placed on their own node
+    s_thread_count = ic::init_pfor(thread_count, true, s_thread_cpus.empty() ? nullptr : PinPoolThread, nullptr);
+    return s_thread_count;
+}
+
+void ShutdownThreading()
+{
+    s_async_tasks.wait();
+    ic::shut_pfor();
+    s_thread_count = 0;
+}
+
+int GetThreadCount()
+{
+    return s_thread_count;
+}
+
+ThreadingStats GetThreadingStats()
+{
+    ic::ThreadStats thread_stats[IC_MAX_THREAD_COUNT + 1];
+    ic::ForStats for_stats;
+    const int count = ic::get_stats(thread_stats, IC_MAX_THREAD_COUNT + 1, &for_stats);
+    ThreadingStats stats;
+    for (int i = 0; i < count; ++i)
+    {
+        stats.tasks += thread_stats[i].tasks;
+        stats.busy_time += thread_stats[i].busy_time;
+        stats.idle_time += thread_stats[i].idle_time;
+    }
+    stats.tail_time = for_stats.tail_time;
+    return stats;
+}
+
+void ResetThreadingStats()
+{
+    ic::reset_stats();
+}
+
+void RunAsyncTask(AsyncTask* task, void* context)
+{
+    // with no other threads, nothing would run the task while the caller waits for it
+    if (s_thread_count <= 1)
+    {
+        task(context, 0);
+        return;
+    }
+    s_async_tasks.run(task, context);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <future>
+#include <stdint.h>
+
+// One thread pool for the whole process: MOP uses it directly, OpenEXR and libjxl
+// through adapters (see InitExr, InitJxl). Returns the actual thread count.
+// With pin_threads, pool threads are pinned to CPUs, spread evenly over NUMA nodes.
+int InitThreading(int thread_count, bool pin_threads = false);
+void ShutdownThreading();
+int GetThreadCount();
+
+// Thread pool statistics since init or the last reset, summed over all threads.
+struct ThreadingStats
+{
+    uint64_t tasks = 0;
+    double busy_time = 0; // seconds spent running tasks
+    double idle_time = 0; // seconds spent waiting for tasks to run
+    double tail_time = 0; // seconds from the first thread running out of work to the end of each parallel for
+};
+ThreadingStats GetThreadingStats();
+void ResetThreadingStats();
+
+// Queues a task to run on the shared thread pool (or runs it right away if the
+// pool has no threads besides the calling one).
+typedef void AsyncTask(void* context, int thread_idx);
+void RunAsyncTask(AsyncTask* task, void* context);
+
+// Runs f() on the shared thread pool, returns a future for its result. Waiting on
+// the future blocks without running other pool tasks, so pool tasks themselves
+// should not wait on futures.
+template <typename F>
+auto RunAsync(F f) -> std::future<decltype(f())>
+{
+    typedef decltype(f()) R;
+    std::packaged_task<R()>* task = new std::packaged_task<R()>(std::move(f));
+    std::future<R> result = task->get_future();
+    RunAsyncTask([](void* context, int /*thread_idx*/) {
+        std::packaged_task<R()>* task = (std::packaged_task<R()>*)context;
+        (*task)();
+        delete task;
+        }, task);
+    return result;
+}
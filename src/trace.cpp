@@ -0,0 +1,107 @@
+#include "trace.h"
+
+#ifdef ENABLE_TRACE
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <vector>
+
+struct TraceEvent
+{
+    const char* name;
+    const char* arg;
+    uint64_t start; // nanoseconds since trace start
+    uint64_t duration;
+};
+
+// Events are recorded into per-thread lists, so that recording does not need a lock.
+struct TraceThread
+{
+    int id;
+    std::vector<TraceEvent> events;
+};
+
+static std::mutex s_trace_mutex;
+static std::vector<std::unique_ptr<TraceThread>> s_trace_threads;
+static const std::chrono::steady_clock::time_point s_trace_start = std::chrono::steady_clock::now();
+
+static uint64_t TraceTime()
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - s_trace_start).count());
+}
+
+static TraceThread* GetTraceThread()
+{
+    static thread_local TraceThread* thread = nullptr;
+    if (thread == nullptr)
+    {
+        std::lock_guard<std::mutex> lock(s_trace_mutex);
+        s_trace_threads.emplace_back(new TraceThread());
+        thread = s_trace_threads.back().get();
+        thread->id = int(s_trace_threads.size()) - 1;
+        thread->events.reserve(1024);
+    }
+    return thread;
+}
+
+TraceScope::TraceScope(const char* name, const char* arg)
+    : m_name(name), m_arg(arg), m_start(TraceTime())
+{
+}
+
+TraceScope::~TraceScope()
+{
+    const uint64_t end = TraceTime();
+    GetTraceThread()->events.push_back({m_name, m_arg, m_start, end - m_start});
+}
+
+static void WriteJsonString(FILE* f, const char* str)
+{
+    fputc('"', f);
+    for (; *str; ++str)
+    {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', f);
+        if ((unsigned char)*str >= 0x20)
+            fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
+bool TraceWriteFile(const char* path)
+{
+    FILE* f = fopen(path, "wb");
+    if (f == nullptr)
+    {
+        printf("Failed to write trace file %s\n", path);
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(s_trace_mutex);
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (const auto& thread : s_trace_threads)
+    {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%i,\"args\":{\"name\":\"thread %i\"}}", first ? "" : ",\n", thread->id, thread->id);
+        first = false;
+        for (const TraceEvent& ev : thread->events)
+        {
+            fprintf(f, ",\n{\"name\":");
+            WriteJsonString(f, ev.name);
+            fprintf(f, ",\"ph\":\"X\",\"pid\":0,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f", thread->id, ev.start / 1000.0, ev.duration / 1000.0);
+            if (ev.arg != nullptr)
+            {
+                fprintf(f, ",\"args\":{\"detail\":");
+                WriteJsonString(f, ev.arg);
+                fprintf(f, "}");
+            }
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    return true;
+}
+
+#endif // #ifdef ENABLE_TRACE
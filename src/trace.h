@@ -0,0 +1,37 @@
+#pragma once
+
+// Optional recording of timed scopes into a Chrome trace file (open it in
+// https://ui.perfetto.dev or chrome://tracing). Compiled in only when
+// ENABLE_TRACE is defined (ENABLE_TRACE cmake option); otherwise the
+// TRACE_ macros do nothing.
+
+#ifdef ENABLE_TRACE
+
+#include <stdint.h>
+
+struct TraceScope
+{
+    // name and arg have to stay alive until the trace is written (e.g. string literals)
+    TraceScope(const char* name, const char* arg = nullptr);
+    ~TraceScope();
+private:
+    const char* m_name;
+    const char* m_arg;
+    uint64_t m_start;
+};
+
+// Writes all recorded events into a JSON file. Should be called when no
+// other threads are recording events.
+bool TraceWriteFile(const char* path);
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_SCOPE_ARG(name, arg) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name, arg)
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_ARG(name, arg)
+
+#endif
@@ -0,0 +1,158 @@
+// OpenEXR tests: all compression types give back exactly the pixels they were given
+// (channels matched by name, since EXR sorts them), also when loading only some channels.
+
+#include "test_util.h"
+#include "fileio.h"
+#include "threading.h"
+#include "image_exr.h"
+
+#include <memory>
+
+static const CompressorType kExrTypes[] = {
+    CompressorType::ExrNone, CompressorType::ExrRLE, CompressorType::ExrPIZ,
+    CompressorType::ExrZIP, CompressorType::ExrHTJ2K_32, CompressorType::ExrHTJ2K_256,
+};
+
+static void TestExrChannelSubsets()
+{
+    const Image rgba = MakeNormalImage(317, 129, {{"R", true}, {"G", true}, {"B", true}, {"A", true}}, 5);
+    const Image mixed = MakeNormalImage(317, 129, {{"diffuse.R", true}, {"diffuse.G", true}, {"diffuse.B", true}, {"depth.Z", false}}, 6);
+    for (CompressorType type : kExrTypes)
+    {
+        for (const Image* img : {&rgba, &mixed})
+        {
+            MyOStream out;
+            CHECK(SaveExrFile(out, *img, type, 0));
+            Image got;
+            {
+                MyIStream in(out.data(), out.size());
+                CHECK(LoadExrFile(in, got));
+            }
+            CHECK(SameChannelsByName(*img, got));
+
+            // two channels, given in a different order than in the file
+            const std::vector<std::string> names = {img->channels[3].name, img->channels[1].name};
+            Image sub;
+            {
+                MyIStream in(out.data(), out.size());
+                CHECK(LoadExrFile(in, sub, names));
+            }
+            CHECK(sub.channels.size() == 2);
+            CHECK(SameRegion(*img, sub, 0, 0));
+            Image missing;
+            MyIStream in(out.data(), out.size());
+            CHECK(!LoadExrFile(in, missing, {"no such channel"}));
+        }
+    }
+}
+
+// Saving from a planar view, and loading into one.
+static void TestExrViews()
+{
+    const Image img = MakeNormalImage(317, 129, {{"diffuse.R", true}, {"diffuse.G", true}, {"diffuse.B", true}, {"depth.Z", false}}, 9);
+    std::unique_ptr<char[]> planar;
+    const ImageView planar_view = MakePlanarCopy(img, planar);
+    MyOStream out;
+    CHECK(SaveExrFile(out, planar_view, CompressorType::ExrZIP, 0));
+    Image got;
+    {
+        MyIStream in(out.data(), out.size());
+        CHECK(LoadExrFile(in, got));
+    }
+    CHECK(SameChannelsByName(img, got));
+
+    std::unique_ptr<char[]> planar_got(new char[img.pixels_size]);
+    ImageView planar_got_view = planar_view;
+    for (ImageView::Channel& ch : planar_got_view.channels)
+        ch.base = planar_got.get() + (ch.base - planar.get());
+    {
+        MyIStream in(out.data(), out.size());
+        CHECK(LoadExrFile(in, planar_got_view));
+    }
+    CHECK(memcmp(planar.get(), planar_got.get(), img.pixels_size) == 0);
+    ImageView wrong_size = planar_got_view;
+    wrong_size.height++;
+    MyIStream in(out.data(), out.size());
+    CHECK(!LoadExrFile(in, wrong_size));
+}
+
+// OpenEXR runs its work on the shared pool: results must not depend on the thread
+// count, and saves / loads started from pool tasks (where OpenEXR work runs inline)
+// must work too.
+static void TestExrSharedPool()
+{
+    const Image img = MakeNormalImage(640, 300, {{"B", true}, {"G", true}, {"R", true}, {"Z", false}}, 7);
+    MyOStream ref;
+    CHECK(SaveExrFile(ref, img, CompressorType::ExrZIP, 0));
+    const char* ref_data = ref.data(); // merges segments once; tasks below only read it
+    for (int threads : {1, 2, 8, 4})
+    {
+        ShutdownThreading();
+        InitThreading(threads);
+        for (CompressorType type : {CompressorType::ExrZIP, CompressorType::ExrPIZ, CompressorType::ExrHTJ2K_32})
+        {
+            MyOStream out;
+            CHECK(SaveExrFile(out, img, type, 0));
+            Image got;
+            MyIStream in(out.data(), out.size());
+            CHECK(LoadExrFile(in, got));
+            CHECK(SameChannelsByName(img, got));
+        }
+        std::vector<MyOStream> outs(6);
+        std::vector<Image> got(outs.size());
+        std::vector<std::future<bool>> results;
+        for (size_t i = 0; i < outs.size(); ++i)
+        {
+            results.push_back(RunAsync([&, i]() {
+                MyIStream in(ref_data, ref.size());
+                return SaveExrFile(outs[i], img, CompressorType::ExrZIP, 0) && LoadExrFile(in, got[i]);
+                }));
+        }
+        for (size_t i = 0; i < outs.size(); ++i)
+        {
+            CHECK(results[i].get());
+            CHECK(outs[i].size() == ref.size() && memcmp(outs[i].data(), ref_data, ref.size()) == 0);
+            CHECK(SameChannelsByName(img, got[i]));
+        }
+    }
+}
+
+// Async saves and loads of several files at once on the shared pool.
+static void TestExrAsync()
+{
+    const Image img = MakeNormalImage(317, 129, {{"diffuse.R", true}, {"diffuse.G", true}, {"diffuse.B", true}, {"depth.Z", false}}, 8);
+    std::vector<MyOStream> outs(4);
+    std::vector<std::future<bool>> results;
+    for (MyOStream& out : outs)
+        results.push_back(SaveExrFileAsync(out, img, CompressorType::ExrZIP, 0));
+    for (auto& r : results)
+        CHECK(r.get());
+    std::vector<std::unique_ptr<MyIStream>> ins;
+    std::vector<Image> got(outs.size());
+    results.clear();
+    for (size_t i = 0; i < outs.size(); ++i)
+    {
+        ins.emplace_back(new MyIStream(outs[i].data(), outs[i].size()));
+        results.push_back(LoadExrFileAsync(*ins[i], got[i], i % 2 ? std::vector<std::string>{"depth.Z"} : std::vector<std::string>{}));
+    }
+    for (size_t i = 0; i < outs.size(); ++i)
+    {
+        CHECK(results[i].get());
+        if (i % 2)
+            CHECK(got[i].channels.size() == 1 && SameRegion(img, got[i], 0, 0));
+        else
+            CHECK(SameChannelsByName(img, got[i]));
+    }
+}
+
+int main()
+{
+    InitThreading(4);
+    InitExr();
+    TestExrChannelSubsets();
+    TestExrViews();
+    TestExrSharedPool();
+    TestExrAsync();
+    ShutdownThreading();
+    return TestResult();
+}
@@ -0,0 +1,130 @@
+// File and memory stream tests: memory mapped input has to read the same as
+// regular input, and segmented output has to hold exactly what was written.
+
+#include "test_util.h"
+#include "fileio.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+static const char* kTempFile = "test_fileio.tmp";
+static const char* kTempEmptyFile = "test_fileio_empty.tmp";
+
+static bool WriteTempFile(const char* name, const std::vector<char>& data)
+{
+    FILE* f = fopen(name, "wb");
+    if (f == nullptr)
+        return false;
+    const bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+// Reading past the end fails without moving the position (or throws, when built for OpenEXR).
+static bool ReadsPastEnd(MyIStream& in, int n)
+{
+    std::vector<char> buf(n);
+    const uint64_t pos = in.tellg();
+    try
+    {
+        in.read(buf.data(), n);
+        return in.tellg() != pos;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+static void TestMemoryMappedInput()
+{
+    std::vector<char> data(100000 + 123);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = char(i * 7 + (i >> 8));
+    CHECK(WriteTempFile(kTempFile, data));
+    CHECK(WriteTempFile(kTempEmptyFile, {}));
+    {
+        MyIStream mapped(kTempFile, true), read(kTempFile);
+        CHECK(mapped.size() == data.size() && read.size() == data.size());
+        CHECK(memcmp(mapped.data(), data.data(), data.size()) == 0);
+        CHECK(memcmp(read.data(), data.data(), data.size()) == 0);
+
+        uint32_t v = 0, expected = 0;
+        memcpy(&expected, data.data() + 4, 4);
+        mapped.seekg(4);
+        mapped.read(v);
+        CHECK(v == expected && mapped.tellg() == 8);
+        mapped.seekg(data.size() - 4);
+        mapped.read(v);
+        memcpy(&expected, data.data() + data.size() - 4, 4);
+        CHECK(v == expected && mapped.tellg() == data.size());
+        CHECK(!ReadsPastEnd(mapped, 1));
+    }
+    {
+        // empty files can not be mapped, and fall back to reading
+        MyIStream mapped(kTempEmptyFile, true);
+        CHECK(mapped.size() == 0);
+        CHECK(!ReadsPastEnd(mapped, 1));
+    }
+    remove(kTempFile);
+    remove(kTempEmptyFile);
+}
+
+// Random appends, overwrites and seeks past the end (which zero-fill the gap), with
+// various size hints and reserve calls; compared against a plain vector.
+static void TestSegmentedOutput()
+{
+    for (size_t hint : {0, 10, 5000, 3000000})
+    {
+        for (int reserve_at : {-1, 0, 7, 100})
+        {
+            MyOStream out(hint);
+            std::vector<char> ref;
+            srand(unsigned(hint + reserve_at));
+            bool same_size = true;
+            for (int it = 0; it < 300; ++it)
+            {
+                if (it == reserve_at)
+                    out.reserve(out.size() + 2500000);
+                const int n = rand() % 30000;
+                std::vector<char> buf(n);
+                for (char& c : buf)
+                    c = char(rand());
+                size_t pos = ref.size();
+                if (rand() % 7 == 0)
+                    pos = ref.size() + rand() % 20000;
+                else if (rand() % 5 == 0 && !ref.empty())
+                    pos = rand() % ref.size();
+                out.seekp(pos);
+                out.write(buf.data(), n);
+                ref.resize(std::max(ref.size(), pos + n));
+                memcpy(ref.data() + pos, buf.data(), n);
+                out.seekp(ref.size());
+                same_size &= out.size() == ref.size();
+            }
+            CHECK(same_size);
+            CHECK(out.write_file(kTempFile));
+            {
+                MyIStream in(kTempFile);
+                CHECK(in.size() == ref.size() && memcmp(in.data(), ref.data(), ref.size()) == 0);
+            }
+            CHECK(memcmp(out.data(), ref.data(), ref.size()) == 0);
+            // writing after data() merged the segments
+            out.write("abc", 3);
+            ref.insert(ref.end(), {'a', 'b', 'c'});
+            CHECK(out.size() == ref.size() && memcmp(out.data(), ref.data(), ref.size()) == 0);
+        }
+    }
+    MyOStream empty;
+    CHECK(empty.size() == 0);
+    CHECK(empty.write_file(kTempFile));
+    MyIStream in(kTempFile);
+    CHECK(in.size() == 0);
+    remove(kTempFile);
+}
+
+int main()
+{
+    TestMemoryMappedInput();
+    TestSegmentedOutput();
+    return TestResult();
+}
@@ -0,0 +1,205 @@
+// Image utility tests: SIMD / parallel pixel processing has to match plain scalar code,
+// and image comparison has to find every difference.
+
+#include "test_util.h"
+#include "threading.h"
+
+#include <memory>
+#include <random>
+
+// Scalar SanitizePixelValues: sets fp16 subnormals to zero, returns how many were changed.
+static size_t SanitizeReference(Image& image)
+{
+    const size_t pixel_stride = image.pixels_size / (image.width * image.height);
+    size_t changed = 0;
+    for (size_t i = 0; i < image.width * image.height; ++i)
+    {
+        for (const Image::Channel& ch : image.channels)
+        {
+            if (!ch.fp16)
+                continue;
+            char* ptr = image.pixels.get() + i * pixel_stride + ch.offset;
+            uint16_t v;
+            memcpy(&v, ptr, 2);
+            if ((v & 0x7C00) == 0 && (v & 0x03FF) != 0)
+            {
+                memset(ptr, 0, 2);
+                ++changed;
+            }
+        }
+    }
+    return changed;
+}
+
+// Random sizes and channel layouts (also with odd pixel sizes, and images smaller than a
+// SIMD register), a quarter of values forced into zero / subnormal range.
+static void TestSanitizePixelValues()
+{
+    std::mt19937 rng(1);
+    bool same = true;
+    for (int test = 0; test < 60; ++test)
+    {
+        Image img;
+        img.width = 1 + rng() % 700;
+        img.height = 1 + rng() % 300;
+        size_t pixel_size = 0;
+        const int channel_count = 1 + rng() % 7;
+        for (int c = 0; c < channel_count; ++c)
+        {
+            const bool fp16 = rng() % 3 != 0;
+            img.channels.push_back({"c" + std::to_string(c), fp16, pixel_size});
+            pixel_size += fp16 ? 2 : 4;
+        }
+        img.pixels_size = img.width * img.height * pixel_size;
+        img.pixels = MakePixelBuffer(img.pixels_size);
+        for (size_t i = 0; i < img.pixels_size / 2; ++i)
+        {
+            uint16_t v = uint16_t(rng());
+            if (rng() % 4 == 0)
+                v &= 0x83FF;
+            memcpy(img.pixels.get() + i * 2, &v, 2);
+        }
+        Image ref;
+        ref.width = img.width;
+        ref.height = img.height;
+        ref.channels = img.channels;
+        ref.pixels_size = img.pixels_size;
+        ref.pixels = MakePixelBuffer(img.pixels_size);
+        memcpy(ref.pixels.get(), img.pixels.get(), img.pixels_size);
+
+        const size_t changed = SanitizePixelValues(img);
+        same &= changed == SanitizeReference(ref) && SamePixels(img, ref);
+        // nothing left to change the second time
+        same &= SanitizePixelValues(img) == 0;
+    }
+    CHECK(same);
+
+    // fp32 only images are left alone
+    Image fp32 = MakeNoiseImage(33, 17, "ff", 2);
+    std::unique_ptr<char[]> copy(new char[fp32.pixels_size]);
+    memcpy(copy.get(), fp32.pixels.get(), fp32.pixels_size);
+    CHECK(SanitizePixelValues(fp32) == 0);
+    CHECK(memcmp(copy.get(), fp32.pixels.get(), fp32.pixels_size) == 0);
+}
+
+// Same values as img, with channels stored in the given order.
+static Image ReorderChannels(const Image& img, const std::vector<size_t>& order)
+{
+    Image out;
+    out.width = img.width;
+    out.height = img.height;
+    out.pixels_size = img.pixels_size;
+    out.pixels = MakePixelBuffer(img.pixels_size);
+    size_t offset = 0;
+    for (size_t idx : order)
+    {
+        out.channels.push_back({img.channels[idx].name, img.channels[idx].fp16, offset});
+        offset += img.channels[idx].fp16 ? 2 : 4;
+    }
+    const size_t pixel_size = offset;
+    for (size_t i = 0; i < img.width * img.height; ++i)
+    {
+        for (const Image::Channel& ch : out.channels)
+        {
+            const uint32_t v = ChannelBits(img, ch.name, i % img.width, i / img.width);
+            memcpy(out.pixels.get() + i * pixel_size + ch.offset, &v, ch.fp16 ? 2 : 4);
+        }
+    }
+    return out;
+}
+
+// Channels are matched by name, and values compared bitwise: NaN payloads and signed
+// zeroes count as differences; so do channel type, size and name mismatches.
+static void TestCompareImages()
+{
+    const Image a = MakeNoiseImage(1000, 300, "hfh", 3);
+    const Image same = ReorderChannels(a, {0, 1, 2});
+    const Image reordered = ReorderChannels(a, {1, 2, 0});
+    CHECK(CompareImages(a, same));
+    CHECK(CompareImages(a, reordered));
+    CHECK(CompareImages(reordered, a));
+
+    // one value differs in the last row: NaN payload in fp32, or -0 vs +0 in fp16
+    const size_t x = 5, y = 299;
+    Image nan = ReorderChannels(a, {0, 1, 2});
+    const uint32_t nan_bits = 0x7FC00001;
+    memcpy(nan.pixels.get() + (y * a.width + x) * 8 + 2, &nan_bits, 4);
+    Image nan2 = ReorderChannels(nan, {0, 1, 2});
+    const uint32_t nan2_bits = 0x7FC00002;
+    memcpy(nan2.pixels.get() + (y * a.width + x) * 8 + 2, &nan2_bits, 4);
+    CHECK(!CompareImages(nan, nan2));
+    CHECK(CompareImages(nan, ReorderChannels(nan, {2, 0, 1})));
+    Image zero = ReorderChannels(a, {0, 1, 2});
+    memcpy(zero.pixels.get() + (y * a.width + x) * 8, "\x00\x00", 2);
+    Image negative_zero = ReorderChannels(zero, {0, 1, 2});
+    memcpy(negative_zero.pixels.get() + (y * a.width + x) * 8, "\x00\x80", 2);
+    CHECK(!CompareImages(zero, negative_zero));
+
+    // mismatching layouts
+    const Image other_type = MakeNoiseImage(1000, 300, "hhf", 3);
+    CHECK(!CompareImages(a, other_type));
+    const Image other_size = MakeNoiseImage(300, 1000, "hfh", 3);
+    CHECK(!CompareImages(a, other_size));
+    Image other_name = ReorderChannels(a, {0, 1, 2});
+    other_name.channels[2].name = "other";
+    CHECK(!CompareImages(a, other_name));
+}
+
+// Interleaved, planar and gapped views of the same pixels; copies between them.
+static void TestImageViews()
+{
+    const Image img = MakeNoiseImage(123, 45, "hfhh", 4);
+    const ImageView view(img);
+    char* data = nullptr;
+    CHECK(view.GetInterleavedStride(data) == 10 && data == img.pixels.get());
+
+    std::unique_ptr<char[]> planar;
+    const ImageView planar_view = MakePlanarCopy(img, planar);
+    CHECK(planar_view.GetInterleavedStride(data) == 0);
+
+    // channels in reverse order with a 4 byte gap at pixel end: interleaved, but not like an Image
+    const size_t gap_stride = 14;
+    std::unique_ptr<char[]> gapped(new char[img.width * img.height * gap_stride]);
+    ImageView gapped_view;
+    gapped_view.width = img.width;
+    gapped_view.height = img.height;
+    size_t offset = 0;
+    for (size_t idx = img.channels.size(); idx-- > 0; )
+    {
+        const Image::Channel& ch = img.channels[idx];
+        gapped_view.channels.push_back({ch.name, ch.fp16, gapped.get() + offset, gap_stride, gap_stride * img.width});
+        offset += ch.fp16 ? 2 : 4;
+    }
+    CHECK(gapped_view.GetInterleavedStride(data) == gap_stride && data == gapped.get());
+
+    CHECK(CopyImageView(planar_view, gapped_view));
+    Image back;
+    back.width = img.width;
+    back.height = img.height;
+    back.channels = img.channels;
+    back.pixels_size = img.pixels_size;
+    back.pixels = MakePixelBuffer(img.pixels_size);
+    CHECK(CopyImageView(gapped_view, ImageView(back)));
+    CHECK(SamePixels(img, back));
+
+    // size, channel name and type mismatches
+    ImageView wrong = gapped_view;
+    wrong.width--;
+    CHECK(!CopyImageView(planar_view, wrong));
+    wrong = gapped_view;
+    wrong.channels[0].name = "other";
+    CHECK(!CopyImageView(planar_view, wrong));
+    wrong = gapped_view;
+    wrong.channels[0].fp16 = !wrong.channels[0].fp16;
+    CHECK(!CopyImageView(planar_view, wrong));
+}
+
+int main()
+{
+    InitThreading(4);
+    TestSanitizePixelValues();
+    TestCompareImages();
+    TestImageViews();
+    ShutdownThreading();
+    return TestResult();
+}
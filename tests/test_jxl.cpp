@@ -0,0 +1,118 @@
+// JPEG XL tests: lossless encoding has to give back exactly the pixels it was given
+// (channels matched by name).
+
+#include "test_util.h"
+#include "fileio.h"
+#include "threading.h"
+#include "image_jxl.h"
+
+#include <memory>
+
+// Color channels are gathered into the interleaved layout libjxl takes, with separate
+// kernels for 1, 3 and 4 channels of fp16 and fp32, from interleaved (also channel
+// reversed, as EXR stores them) or planar sources; widths that are not a multiple of
+// any SIMD width, and a one pixel wide image.
+static void TestJxlGatherLayouts()
+{
+    typedef std::vector<std::pair<std::string, bool>> Channels;
+    for (bool fp16 : {true, false})
+    {
+        const std::vector<Channels> layouts = {
+            {{"Y", fp16}},
+            {{"R", fp16}, {"G", fp16}, {"B", fp16}},
+            {{"B", fp16}, {"G", fp16}, {"R", fp16}},
+            {{"R", fp16}, {"G", fp16}, {"B", fp16}, {"A", fp16}},
+            {{"A", fp16}, {"B", fp16}, {"G", fp16}, {"R", fp16}},
+        };
+        for (const Channels& layout : layouts)
+        {
+            for (size_t width : {1, 300, 513})
+            {
+                const Image img = MakeNormalImage(width, 270, layout, unsigned(width + layout.size()));
+                std::unique_ptr<char[]> planar;
+                const ImageView planar_view = MakePlanarCopy(img, planar);
+                for (const ImageView& view : {ImageView(img), planar_view})
+                {
+                    MyOStream out;
+                    CHECK(SaveJxlFile(out, view, 1));
+                    Image got;
+                    MyIStream in(out.data(), out.size());
+                    CHECK(LoadJxlFile(in, got));
+                    CHECK(SameChannelsByName(img, got));
+                }
+            }
+        }
+    }
+}
+
+// Images larger than one 256x256 group are encoded in chunks, with color and extra
+// channels asked for by rectangle (planar extra channels are passed in place), and
+// output streamed into the stream after anything already written there.
+static void TestJxlChunked()
+{
+    const Image rgba = MakeNormalImage(700, 600, {{"R", true}, {"G", true}, {"B", true}, {"A", true}, {"depth.Z", false}, {"mask", true}}, 12);
+    const Image gray = MakeNormalImage(257, 513, {{"Y", false}, {"depth.Z", false}, {"mask", true}}, 13);
+    for (const Image* img : {&rgba, &gray})
+    {
+        std::unique_ptr<char[]> planar;
+        const ImageView planar_view = MakePlanarCopy(*img, planar);
+        for (const ImageView& view : {ImageView(*img), planar_view})
+        {
+            MyOStream out;
+            const char prefix[] = "prefix";
+            out.write(prefix, sizeof(prefix));
+            CHECK(SaveJxlFile(out, view, 1));
+            CHECK(memcmp(out.data(), prefix, sizeof(prefix)) == 0);
+            Image got;
+            {
+                MyIStream in(out.data() + sizeof(prefix), out.size() - sizeof(prefix));
+                CHECK(LoadJxlFile(in, got));
+            }
+            CHECK(SameChannelsByName(*img, got));
+
+            std::unique_ptr<char[]> planar_got(new char[img->pixels_size]);
+            ImageView planar_got_view = planar_view;
+            for (ImageView::Channel& ch : planar_got_view.channels)
+                ch.base = planar_got.get() + (ch.base - planar.get());
+            MyIStream in(out.data() + sizeof(prefix), out.size() - sizeof(prefix));
+            CHECK(LoadJxlFile(in, planar_got_view));
+            CHECK(memcmp(planar.get(), planar_got.get(), img->pixels_size) == 0);
+        }
+    }
+}
+
+// Async saves and loads of several files at once on the shared pool.
+static void TestJxlAsync()
+{
+    const Image img = MakeNormalImage(300, 300, {{"A", true}, {"B", true}, {"G", true}, {"R", true}}, 8);
+    std::vector<MyOStream> outs(3);
+    std::vector<std::future<bool>> results;
+    for (MyOStream& out : outs)
+        results.push_back(SaveJxlFileAsync(out, img, 1));
+    for (auto& r : results)
+        CHECK(r.get());
+    std::vector<std::unique_ptr<MyIStream>> ins;
+    std::vector<Image> got(outs.size());
+    results.clear();
+    for (size_t i = 0; i < outs.size(); ++i)
+    {
+        ins.emplace_back(new MyIStream(outs[i].data(), outs[i].size()));
+        results.push_back(LoadJxlFileAsync(*ins[i], got[i]));
+    }
+    for (size_t i = 0; i < outs.size(); ++i)
+    {
+        CHECK(results[i].get());
+        CHECK(SameChannelsByName(img, got[i]));
+    }
+}
+
+int main()
+{
+    InitThreading(4);
+    InitJxl();
+    TestJxlGatherLayouts();
+    TestJxlChunked();
+    TestJxlAsync();
+    ShutdownThreading();
+    return TestResult();
+}
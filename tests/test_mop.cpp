@@ -0,0 +1,546 @@
+// MOP format tests: every flag combination has to give back exactly the pixels it was
+// given, regions and channel subsets have to match the full image, and malformed files
+// have to be rejected instead of read out of bounds.
+
+#include "test_util.h"
+#include "fileio.h"
+#include "threading.h"
+#include "image_mop.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+static bool LoadMopRegionBytes(MyOStream& file, size_t x0, size_t y0, size_t w, size_t h, Image& r_image, const std::vector<std::string>& channels = {})
+{
+    MyIStream in(file.data(), file.size());
+    return LoadMopRegion(in, x0, y0, w, h, r_image, channels);
+}
+
+// Saves the image with given settings, loads it back whole and as a region.
+static void TestMopCase(const Image& img, int cmp_level)
+{
+    MyOStream out;
+    CHECK(SaveMopFile(out, img, cmp_level));
+    Image got;
+    {
+        MyIStream in(out.data(), out.size());
+        CHECK(LoadMopFile(in, got));
+    }
+    CHECK(SamePixels(img, got));
+
+    // region in the middle, not aligned to tiles or chunks
+    const size_t x0 = img.width / 3, y0 = img.height / 4;
+    const size_t w = img.width - x0 - img.width / 5, h = img.height - y0 - img.height / 6;
+    Image region;
+    CHECK(LoadMopRegionBytes(out, x0, y0, w, h, region));
+    CHECK(region.width == w && region.height == h && SameRegion(img, region, x0, y0));
+}
+
+static void TestMopLevels(const std::vector<int>& levels)
+{
+    const char* types[] = {"h", "hhh", "ffff", "hf", "hhhh", "fhh", "hhhhh", "hhhhfh", "hfhhhh"};
+    const size_t sizes[][2] = {{1, 1}, {7, 3}, {300, 200}, {1000, 33}, {129, 257}, {256, 128}};
+    for (const char* type : types)
+    {
+        for (const auto& size : sizes)
+        {
+            Image noise = MakeNoiseImage(size[0], size[1], type, 1);
+            // mostly constant image: first half zero, rest one value, one odd pixel
+            Image flat = MakeNoiseImage(size[0], size[1], type, 2);
+            const size_t half = std::min(flat.pixels_size, flat.pixels_size / 2 + 3);
+            memset(flat.pixels.get(), 0, half);
+            memset(flat.pixels.get() + half, 0x3c, flat.pixels_size - half);
+            flat.pixels[flat.pixels_size * 3 / 4] = 1;
+            for (int level : levels)
+            {
+                TestMopCase(noise, level);
+                TestMopCase(flat, level);
+            }
+        }
+    }
+}
+
+static void TestMopRegions(int cmp_level)
+{
+    const Image img = MakeNoiseImage(300, 260, "hfh", 3);
+    MyOStream out;
+    CHECK(SaveMopFile(out, img, cmp_level));
+    const size_t rects[][4] = {
+        {0, 0, 300, 260}, // whole image
+        {0, 0, 1, 1}, {299, 259, 1, 1}, {128, 128, 1, 1}, {127, 127, 2, 2}, // single pixels and tile corners
+        {256, 0, 44, 260}, {0, 256, 300, 4}, {250, 250, 50, 10}, // partial edge tiles
+        {10, 100, 280, 1}, {5, 0, 1, 260}, // single row / column
+    };
+    for (const auto& r : rects)
+    {
+        Image region;
+        CHECK(LoadMopRegionBytes(out, r[0], r[1], r[2], r[3], region));
+        CHECK(region.width == r[2] && region.height == r[3] && SameRegion(img, region, r[0], r[1]));
+    }
+    // empty and out of range rectangles are rejected
+    const size_t bad_rects[][4] = {
+        {0, 0, 0, 10}, {0, 0, 10, 0}, {0, 0, 301, 1}, {0, 0, 1, 261}, {300, 0, 1, 1}, {0, 260, 1, 1},
+        {299, 0, 2, 1}, {SIZE_MAX, 0, 2, 1}, {0, SIZE_MAX, 1, 2}, {1, 0, SIZE_MAX, 1},
+    };
+    for (const auto& r : bad_rects)
+    {
+        Image region;
+        CHECK(!LoadMopRegionBytes(out, r[0], r[1], r[2], r[3], region));
+    }
+}
+
+template<typename T> static void Append(std::vector<char>& file, T v)
+{
+    file.insert(file.end(), (const char*)&v, (const char*)&v + sizeof(v));
+}
+
+// Malformed input may either fail to load or throw (the stream throws at end of file
+// when built for OpenEXR), but must not crash or read out of bounds.
+static bool LoadsMop(const std::vector<char>& file)
+{
+    try
+    {
+        MyIStream in(file.data(), file.size());
+        Image img;
+        return LoadMopFile(in, img);
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+static bool LoadsMopRegion(const std::vector<char>& file, size_t x0, size_t y0, size_t w, size_t h)
+{
+    try
+    {
+        MyIStream in(file.data(), file.size());
+        Image img;
+        return LoadMopRegion(in, x0, y0, w, h, img);
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+static void TestMopMalformed()
+{
+    const Image img = MakeNoiseImage(300, 200, "h", 4);
+    MyOStream out;
+    CHECK(SaveMopFile(out, img, 2));
+    const std::vector<char> file(out.data(), out.data() + out.size());
+    CHECK(LoadsMop(file));
+    CHECK(LoadsMopRegion(file, 10, 10, 100, 100));
+    // header: magic, width, height, flags, channel count, type, name length, name; size table follows
+    const size_t flags_pos = 12, table_pos = 29;
+
+    std::vector<char> bad = file;
+    bad[0] = 'X';
+    CHECK(!LoadsMop(bad));
+    bad = file;
+    bad[flags_pos + 3] = 0x40; // unknown flag
+    CHECK(!LoadsMop(bad));
+    for (int32_t size : {0, -5, 0x7fffffff})
+    {
+        bad = file;
+        memcpy(bad.data() + 4, &size, 4);
+        CHECK(!LoadsMop(bad));
+        CHECK(!LoadsMopRegion(bad, 0, 0, 1, 1));
+    }
+
+    // every truncation of the file
+    for (size_t size = 0; size < file.size(); size += size < table_pos + 64 ? 1 : 97)
+    {
+        const std::vector<char> cut(file.begin(), file.begin() + size);
+        CHECK(!LoadsMop(cut));
+        CHECK(!LoadsMopRegion(cut, 0, 150, 300, 50));
+    }
+
+    // chunk sizes that are too large, or wrap around when summed up
+    const uint64_t sizes[][2] = {{3, ~0ull}, {3, ~0ull - 100}, {3, 1ull << 63}, {~0ull, ~0ull}, {1ull << 63, 1ull << 63}};
+    for (const auto& s : sizes)
+    {
+        bad = file;
+        memcpy(bad.data() + table_pos, &s[0], 8);
+        memcpy(bad.data() + table_pos + 8, &s[1], 8);
+        CHECK(!LoadsMop(bad));
+        CHECK(!LoadsMopRegion(bad, 0, 0, 1, 1));
+    }
+
+    // 64x1 image with one zstd compressed chunk whose frame header claims 8GB of content:
+    // has to be rejected before allocating anything for it
+    std::vector<char> huge = {'M', 'O', 'P', 'F'};
+    Append<int32_t>(huge, 64);
+    Append<int32_t>(huge, 1);
+    Append<int32_t>(huge, 1 | 16); // zstd, chunk modes
+    Append<int32_t>(huge, 1);
+    Append<int32_t>(huge, 0);
+    Append<int32_t>(huge, 1);
+    huge.push_back('Y');
+    std::vector<char> chunk = {3}; // mesh optimizer + zstd
+    Append<uint32_t>(chunk, 0xFD2FB528u); // zstd frame magic
+    chunk.push_back(char(0xE0)); // frame header: single segment, 8 byte content size
+    Append<uint64_t>(chunk, 8ull << 30);
+    Append<uint32_t>(chunk, 0);
+    Append<uint64_t>(huge, chunk.size());
+    huge.insert(huge.end(), chunk.begin(), chunk.end());
+    CHECK(!LoadsMop(huge));
+    CHECK(!LoadsMopRegion(huge, 0, 0, 64, 1));
+}
+
+// Tiled layout: 300x260 with 128x128 tiles has partial tiles on the right and bottom
+// edges; also a hand made file with 256x256 tiles, larger than the untiled chunk size.
+static void TestMopTiled()
+{
+    TestMopLevels({2 | kMopTiled, 1 | (1 << 8) | kMopTiled});
+    TestMopRegions(2 | kMopTiled);
+    TestMopRegions(2 | (3 << 8) | kMopTiled);
+
+    std::vector<char> tiled = {'M', 'O', 'P', 'F'};
+    Append<int32_t>(tiled, 300);
+    Append<int32_t>(tiled, 260);
+    Append<int32_t>(tiled, 2 | 16); // tiled, chunk modes
+    Append<int32_t>(tiled, 256);
+    Append<int32_t>(tiled, 1);
+    Append<int32_t>(tiled, 0);
+    Append<int32_t>(tiled, 1);
+    tiled.push_back('Y');
+    for (int i = 0; i < 4; ++i)
+        Append<uint64_t>(tiled, 3);
+    for (int i = 0; i < 4; ++i)
+    {
+        tiled.push_back(0); // constant chunk
+        Append<uint16_t>(tiled, uint16_t(0x3c00 + i));
+    }
+    Image got;
+    {
+        MyIStream in(tiled.data(), tiled.size());
+        CHECK(LoadMopFile(in, got));
+    }
+    CHECK(got.width == 300 && got.height == 260);
+    CHECK(ChannelBits(got, "Y", 0, 0) == 0x3c00 && ChannelBits(got, "Y", 299, 0) == 0x3c01);
+    CHECK(ChannelBits(got, "Y", 0, 259) == 0x3c02 && ChannelBits(got, "Y", 299, 259) == 0x3c03);
+    Image region;
+    {
+        MyIStream in(tiled.data(), tiled.size());
+        CHECK(LoadMopRegion(in, 250, 250, 10, 10, region));
+    }
+    CHECK(SameRegion(got, region, 250, 250));
+    for (int32_t tile_size : {0, -1, 64 * 1024 + 1})
+    {
+        std::vector<char> bad = tiled;
+        memcpy(bad.data() + 16, &tile_size, 4);
+        CHECK(!LoadsMop(bad));
+    }
+}
+
+// Modes of all chunks of an untiled file saved from a "LA.R", "LA.S" image.
+static std::vector<int> GetChunkModes(MyOStream& file, size_t chunk_count)
+{
+    // header: magic, width, height, flags, channel count, then type, name length and name of both channels
+    const size_t table_pos = 44;
+    std::vector<int> modes;
+    if (file.size() < table_pos + chunk_count * 8)
+        return modes;
+    size_t pos = table_pos + chunk_count * 8;
+    for (size_t i = 0; i < chunk_count && pos < file.size(); ++i)
+    {
+        uint64_t size;
+        memcpy(&size, file.data() + table_pos + i * 8, 8);
+        modes.push_back(file.data()[pos]);
+        pos += size;
+    }
+    return modes;
+}
+
+// Each chunk picks the cheapest mode: constant chunks store one pixel, and data that
+// does not compress is stored raw instead of growing.
+static void TestMopChunkModes()
+{
+    // 300x200 pixels is four 16K pixel chunks, the last one partial; 4 byte pixels
+    // need no padding, so random data does not compress at all
+    const size_t chunk_count = 4, chunk_size = 16 * 1024 * 4;
+    Image img = MakeNoiseImage(300, 200, "hh", 7);
+    for (size_t i = 0; i < img.pixels_size; ++i)
+        img.pixels[i] = char(rand());
+    // second chunk constant
+    for (size_t i = chunk_size; i < chunk_size * 2; i += 4)
+        memcpy(img.pixels.get() + i, "\x00\x3c\x00\xbc", 4);
+    for (int level : {2, 2 | (3 << 8)})
+    {
+        MyOStream out;
+        CHECK(SaveMopFile(out, img, level));
+        CHECK(GetChunkModes(out, chunk_count) == std::vector<int>({1, 0, 1, 1}));
+        CHECK(out.size() == 44 + chunk_count * 9 + img.pixels_size - chunk_size + 4);
+        Image got;
+        MyIStream in(out.data(), out.size());
+        CHECK(LoadMopFile(in, got));
+        CHECK(SamePixels(img, got));
+    }
+}
+
+// Reversible pixel filters, alone and together with zstd and tiles.
+static void TestMopFilters()
+{
+    std::vector<int> levels;
+    for (int filter : {kMopFilterSignRemap, kMopFilterXorLeft, kMopFilterBytePlanes})
+    {
+        levels.push_back(2 | filter);
+        levels.push_back(2 | (1 << 8) | filter);
+        levels.push_back(1 | (3 << 8) | kMopTiled | filter);
+    }
+    TestMopLevels(levels);
+    TestMopRegions(2 | (3 << 8) | kMopFilterBytePlanes);
+    TestMopRegions(2 | kMopTiled | kMopFilterXorLeft);
+}
+
+// Paired pixels and channel groups, in all combinations with the other flags.
+static void TestMopPairsAndGroups()
+{
+    const int filters[] = {0, kMopFilterSignRemap, kMopFilterXorLeft, kMopFilterBytePlanes};
+    std::vector<int> levels;
+    for (int flags = 0; flags < 16; ++flags)
+    {
+        if ((flags & 12) == 0)
+            continue;
+        const int level = filters[flags % 4] | ((flags & 1) ? kMopTiled : 0) | ((flags & 2) ? kMopStreaming : 0) |
+            ((flags & 4) ? kMopPairPixels : 0) | ((flags & 8) ? kMopChannelGroups : 0);
+        levels.push_back(level | 2 | (flags & 1 ? 1 << 8 : 0));
+    }
+    TestMopLevels(levels);
+
+    // pairs are only used when pixel size is not a multiple of 4; file flags tell
+    for (const char* type : {"hhh", "hh", "f"})
+    {
+        const Image img = MakeNoiseImage(33, 9, type, 8);
+        MyOStream out;
+        CHECK(SaveMopFile(out, img, 2 | kMopPairPixels | kMopChannelGroups));
+        int32_t flags = 0;
+        memcpy(&flags, out.data() + 12, 4);
+        CHECK(((flags & 32) != 0) == (strlen(type) == 3) && (flags & 64) != 0);
+    }
+    TestMopRegions(2 | kMopPairPixels);
+    TestMopRegions(2 | (1 << 8) | kMopTiled | kMopPairPixels | kMopChannelGroups);
+}
+
+// Loading some of the channels (last and second ones, in file order) gives the same
+// values as the full image, whole or as a region; with and without channel groups.
+static void TestMopChannelSubsets()
+{
+    for (const char* type : {"hh", "hhhfh", "fhhhhh"})
+    {
+        const Image img = MakeNoiseImage(300, 211, type, 9);
+        const std::vector<std::string> names = {img.channels.back().name, img.channels[1].name};
+        for (int level : {2, 2 | (1 << 8) | kMopChannelGroups, 2 | kMopTiled | kMopChannelGroups | kMopPairPixels})
+        {
+            MyOStream out;
+            CHECK(SaveMopFile(out, img, level));
+            Image sub;
+            {
+                MyIStream in(out.data(), out.size());
+                CHECK(LoadMopFile(in, sub, names));
+            }
+            CHECK(sub.width == img.width && sub.height == img.height);
+            CHECK(sub.channels.size() == (img.channels.size() == 2 ? 1u : 2u));
+            CHECK(sub.channels[0].name == img.channels[1].name);
+            CHECK(SameRegion(img, sub, 0, 0));
+            Image sub_region;
+            CHECK(LoadMopRegionBytes(out, 150, 70, 150, 141, sub_region, names));
+            CHECK(sub_region.channels.size() == sub.channels.size());
+            CHECK(SameRegion(img, sub_region, 150, 70));
+            Image missing;
+            MyIStream in(out.data(), out.size());
+            CHECK(!LoadMopFile(in, missing, {img.channels[0].name, "no such channel"}));
+            CHECK(!LoadMopRegionBytes(out, 0, 0, 10, 10, missing, {"no such channel"}));
+        }
+    }
+}
+
+// Saving from a planar view writes the same bytes as from an interleaved image, and
+// loading into planar or gapped, channel reordered views gives the same values.
+static void TestMopViews()
+{
+    for (const char* type : {"h", "hhh", "hfhh"})
+    {
+        const Image img = MakeNoiseImage(300, 131, type, 11);
+        std::unique_ptr<char[]> planar;
+        const ImageView planar_view = MakePlanarCopy(img, planar);
+        for (int level : {2, 2 | (1 << 8) | kMopTiled, 2 | kMopPairPixels | kMopChannelGroups | kMopFilterXorLeft})
+        {
+            MyOStream out, out_planar;
+            CHECK(SaveMopFile(out, img, level));
+            CHECK(SaveMopFile(out_planar, planar_view, level));
+            CHECK(out_planar.size() == out.size() && memcmp(out_planar.data(), out.data(), out.size()) == 0);
+
+            std::unique_ptr<char[]> planar_got(new char[img.pixels_size]);
+            ImageView planar_got_view = planar_view;
+            for (ImageView::Channel& ch : planar_got_view.channels)
+                ch.base = planar_got.get() + (ch.base - planar.get());
+            {
+                MyIStream in(out.data(), out.size());
+                CHECK(LoadMopFile(in, planar_got_view));
+            }
+            CHECK(memcmp(planar.get(), planar_got.get(), img.pixels_size) == 0);
+
+            // interleaved with channels in reverse order and a gap at pixel end
+            const size_t gap_stride = img.pixels_size / (img.width * img.height) + 4;
+            std::unique_ptr<char[]> gapped(new char[img.width * img.height * gap_stride]);
+            ImageView gapped_view;
+            gapped_view.width = img.width;
+            gapped_view.height = img.height;
+            size_t offset = 0;
+            for (size_t idx = img.channels.size(); idx-- > 0; )
+            {
+                const Image::Channel& ch = img.channels[idx];
+                gapped_view.channels.push_back({ch.name, ch.fp16, gapped.get() + offset, gap_stride, gap_stride * img.width});
+                offset += ch.fp16 ? 2 : 4;
+            }
+            {
+                MyIStream in(out.data(), out.size());
+                CHECK(LoadMopFile(in, gapped_view));
+            }
+            bool same = true;
+            for (const ImageView::Channel& ch : gapped_view.channels)
+            {
+                for (size_t y = 0; y < img.height; ++y)
+                {
+                    for (size_t x = 0; x < img.width; ++x)
+                    {
+                        uint32_t v = 0;
+                        memcpy(&v, ch.at(x, y), ch.fp16 ? 2 : 4);
+                        same &= v == ChannelBits(img, ch.name, x, y);
+                    }
+                }
+            }
+            CHECK(same);
+
+            ImageView wrong_size = planar_got_view;
+            wrong_size.width++;
+            MyIStream in(out.data(), out.size());
+            CHECK(!LoadMopFile(in, wrong_size));
+        }
+    }
+}
+
+// Per-thread zstd contexts get reused across saves with different levels and across
+// loads; results must not depend on what a context was used for before.
+static void TestMopContextReuse()
+{
+    const Image img = MakeNoiseImage(700, 300, "hhf", 6);
+    const int levels[] = {2 | (1 << 8), 2 | (19 << 8), 3 | (3 << 8), 1 | (10 << 8) | kMopTiled};
+    std::vector<MyOStream> refs(4);
+    const char* ref_data[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        CHECK(SaveMopFile(refs[i], img, levels[i]));
+        ref_data[i] = refs[i].data(); // merges segments once; tasks below only read it
+    }
+    std::vector<MyOStream> outs(16);
+    std::vector<std::future<bool>> results;
+    for (int i = 0; i < 16; ++i)
+    {
+        results.push_back(RunAsync([&, i]() {
+            Image got;
+            MyIStream in(ref_data[(i + 1) % 4], refs[(i + 1) % 4].size());
+            return SaveMopFile(outs[i], img, levels[i % 4]) && LoadMopFile(in, got) && SamePixels(img, got);
+            }));
+    }
+    for (auto& r : results)
+        CHECK(r.get());
+    for (int i = 0; i < 16; ++i)
+        CHECK(outs[i].size() == refs[i % 4].size() && memcmp(outs[i].data(), ref_data[i % 4], outs[i].size()) == 0);
+}
+
+// Async saves and loads of several files at once on the shared pool.
+static void TestMopAsync()
+{
+    std::vector<Image> images;
+    for (int i = 0; i < 6; ++i)
+        images.push_back(MakeNoiseImage(300 + i * 17, 211, i % 2 ? "hhh" : "fhhf", 10 + i));
+    std::vector<MyOStream> outs(images.size());
+    std::vector<std::future<bool>> results;
+    for (size_t i = 0; i < images.size(); ++i)
+        results.push_back(SaveMopFileAsync(outs[i], images[i], 2 | (1 << 8) | (i % 2 ? kMopTiled | kMopStreaming : 0)));
+    for (auto& r : results)
+        CHECK(r.get());
+    std::vector<std::unique_ptr<MyIStream>> ins;
+    std::vector<Image> got(images.size()), sub(images.size());
+    results.clear();
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        ins.emplace_back(new MyIStream(outs[i].data(), outs[i].size()));
+        results.push_back(LoadMopFileAsync(*ins[i], got[i]));
+    }
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        CHECK(results[i].get());
+        CHECK(SamePixels(images[i], got[i]));
+        MyIStream in(outs[i].data(), outs[i].size());
+        CHECK(LoadMopFileAsync(in, sub[i], {"LA.S"}).get());
+        CHECK(sub[i].channels.size() == 1 && SameRegion(images[i], sub[i], 0, 0));
+    }
+}
+
+// Streaming mode has to write exactly the same bytes, with any thread count, also when
+// several saves run at once on pool threads next to unrelated pool work.
+static void TestMopStreaming()
+{
+    const Image img = MakeNoiseImage(1500, 400, "hfh", 5);
+    for (int threads : {1, 2, 3, 8})
+    {
+        ShutdownMop();
+        ShutdownThreading();
+        InitThreading(threads);
+        InitMop();
+        for (int level : {2 | (1 << 8), 2 | (1 << 8) | kMopTiled, 1 | kMopTiled | (3 << 8)})
+        {
+            MyOStream a, b;
+            CHECK(SaveMopFile(a, img, level));
+            CHECK(SaveMopFile(b, img, level | kMopStreaming));
+            CHECK(a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0);
+        }
+        std::vector<MyOStream> outs(threads + 2);
+        std::vector<std::future<bool>> results;
+        std::atomic<int> other(0);
+        for (MyOStream& out : outs)
+        {
+            results.push_back(RunAsync([&]() { return SaveMopFile(out, img, 2 | (1 << 8) | kMopStreaming); }));
+            results.push_back(RunAsync([&]() { ++other; return true; }));
+        }
+        for (auto& r : results)
+            CHECK(r.get());
+        CHECK(other == int(outs.size()));
+        MyOStream ref;
+        CHECK(SaveMopFile(ref, img, 2 | (1 << 8)));
+        for (MyOStream& out : outs)
+            CHECK(out.size() == ref.size() && memcmp(out.data(), ref.data(), ref.size()) == 0);
+    }
+    ShutdownMop();
+    ShutdownThreading();
+    InitThreading(4);
+    InitMop();
+}
+
+int main()
+{
+    InitThreading(4);
+    InitMop();
+    TestMopLevels({0, 1, 2, 3, 2 | (1 << 8), 2 | (3 << 8)});
+    TestMopRegions(2);
+    TestMopRegions(2 | (3 << 8));
+    TestMopMalformed();
+    TestMopTiled();
+    TestMopChunkModes();
+    TestMopFilters();
+    TestMopPairsAndGroups();
+    TestMopChannelSubsets();
+    TestMopViews();
+    TestMopContextReuse();
+    TestMopAsync();
+    TestMopStreaming();
+    ShutdownMop();
+    ShutdownThreading();
+    return TestResult();
+}
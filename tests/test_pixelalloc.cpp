@@ -0,0 +1,108 @@
+// Pixel allocator tests: buffers are aligned, large ones are reused from the pool, and
+// the pool stays within its limit. Pool state and statistics are global, so these run
+// in order on a single allocator.
+
+#include "test_util.h"
+#include "pixelalloc.h"
+
+#include <stdint.h>
+#include <thread>
+
+// Aligned for all sizes; freed large buffers are handed out again for the same size.
+static void TestAlignmentAndReuse()
+{
+    const PixelPoolStats before = GetPixelPoolStats();
+    for (size_t size : {0, 1, 63, 4096, 4097, 65536, 65537, 100000, 1 << 20, (1 << 20) + 1, 3 << 20, 30 << 20})
+    {
+        char* p = AllocPixels(size);
+        CHECK(uintptr_t(p) % kPixelAlignment == 0);
+        memset(p, 0x5a, size);
+        FreePixels(p);
+        char* q = AllocPixels(size);
+        CHECK(uintptr_t(q) % kPixelAlignment == 0);
+        CHECK(size <= 65536 || q == p);
+        FreePixels(q);
+    }
+    const PixelPoolStats after = GetPixelPoolStats();
+    CHECK(after.allocs - before.allocs == 24);
+    CHECK(after.reused - before.reused == 6);
+    FreePixels(nullptr);
+    TrimPixelPool();
+    CHECK(GetPixelPoolStats().pooled_size == 0);
+}
+
+// The default limit is a few times the largest buffer; an explicit limit evicts other
+// pooled buffers, and lowering it trims the pool down to the new limit (not to zero).
+static void TestPoolLimit()
+{
+    {
+        PixelBuffer a = MakePixelBuffer(100 << 20), b = MakePixelBuffer(100 << 20);
+    }
+    CHECK(GetPixelPoolStats().pooled_size >= size_t(200) << 20);
+    TrimPixelPool();
+
+    SetPixelPoolLimit(10 << 20);
+    {
+        PixelBuffer a = MakePixelBuffer(4 << 20), b = MakePixelBuffer(4 << 20), c = MakePixelBuffer(8 << 20);
+    }
+    CHECK(GetPixelPoolStats().pooled_size <= (10 << 20));
+    {
+        PixelBuffer big = MakePixelBuffer(20 << 20);
+    }
+    CHECK(GetPixelPoolStats().pooled_size <= (10 << 20));
+
+    SetPixelPoolLimit(size_t(1) << 30);
+    TrimPixelPool();
+    {
+        PixelBuffer a = MakePixelBuffer(4 << 20), b = MakePixelBuffer(4 << 20), c = MakePixelBuffer(8 << 20);
+    }
+    CHECK(GetPixelPoolStats().pooled_size == (16 << 20));
+    SetPixelPoolLimit(9 << 20);
+    CHECK(GetPixelPoolStats().pooled_size == (8 << 20));
+    SetPixelPoolLimit(0);
+    TrimPixelPool();
+}
+
+// Huge page backed buffers start at a huge page boundary.
+static void TestHugePages()
+{
+    SetPixelHugePages(true);
+    {
+        PixelBuffer buf = MakePixelBuffer(16 << 20);
+        memset(buf.get(), 1, 16 << 20);
+        CHECK(uintptr_t(buf.get()) % (2 << 20) == 0);
+    }
+    SetPixelHugePages(false);
+    TrimPixelPool();
+}
+
+// Small and pooled sizes allocated and freed from several threads at once.
+static void TestThreads()
+{
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([t]() {
+            for (int i = 0; i < 2000; ++i)
+            {
+                const size_t size = size_t(i % 37) * 3000 + t;
+                PixelBuffer buf = MakePixelBuffer(size);
+                if (size > 0)
+                    buf[size - 1] = 1;
+            }
+            });
+    }
+    for (std::thread& t : threads)
+        t.join();
+    TrimPixelPool();
+    CHECK(GetPixelPoolStats().pooled_size == 0);
+}
+
+int main()
+{
+    TestAlignmentAndReuse();
+    TestPoolLimit();
+    TestHugePages();
+    TestThreads();
+    return TestResult();
+}
@@ -0,0 +1,271 @@
+// Thread pool tests: parallel for and task groups have to run every index / task
+// exactly once, also when nested and when called from several threads at once, and no
+// two threads may run with the same thread index at the same time.
+
+#include "test_util.h"
+#include "threading.h"
+#include "systeminfo.h"
+#include "ic_pfor.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+constexpr int kMaxThreads = 64; // IC_MAX_THREAD_COUNT default
+static std::atomic<int> s_index_in_use[kMaxThreads];
+static std::atomic<int> s_bad_index(0);
+
+// Marks thread index as in use for its lifetime; counts indices that are out of range
+// or already in use by another thread.
+struct ThreadIndexGuard
+{
+    int idx;
+    ThreadIndexGuard(int thread_idx) : idx(thread_idx)
+    {
+        if (idx < 0 || idx >= GetThreadCount() || idx >= kMaxThreads || s_index_in_use[idx].exchange(1) != 0)
+        {
+            ++s_bad_index;
+            idx = -1;
+        }
+    }
+    ~ThreadIndexGuard()
+    {
+        if (idx >= 0)
+            s_index_in_use[idx] = 0;
+    }
+};
+
+static void Work(int n)
+{
+    volatile int sum = 0;
+    for (int i = 0; i < n; ++i)
+        sum = sum + i;
+}
+
+// Several non-pool threads at once, each running parallel fors with nested ones inside,
+// and task groups.
+static void TestNestedAndConcurrent()
+{
+    std::atomic<int> bad(0);
+    std::vector<std::thread> callers;
+    for (int caller = 0; caller < 4; ++caller)
+    {
+        callers.emplace_back([&]() {
+            for (int rep = 0; rep < 5; ++rep)
+            {
+                std::atomic<int> outer(0);
+                ic::pfor(100, 3, [&](int /*i*/, int thread_idx) {
+                    {
+                        ThreadIndexGuard guard(thread_idx);
+                        Work(200);
+                    }
+                    // the guard is released first: nested waits may run other tasks with this index
+                    std::atomic<int> inner(0);
+                    ic::pfor(10, 1, [&](int /*j*/, int inner_idx) {
+                        ThreadIndexGuard guard(inner_idx);
+                        Work(100);
+                        ++inner;
+                        });
+                    if (inner != 10)
+                        ++bad;
+                    ++outer;
+                    });
+                if (outer != 100)
+                    ++bad;
+
+                ic::TaskGroup group;
+                std::atomic<int> tasks(0);
+                for (int t = 0; t < 50; ++t)
+                {
+                    group.spawn([&](int thread_idx) {
+                        ThreadIndexGuard guard(thread_idx);
+                        Work(300);
+                        ++tasks;
+                        });
+                }
+                group.wait();
+                if (tasks != 50)
+                    ++bad;
+            }
+            });
+    }
+    for (std::thread& t : callers)
+        t.join();
+    CHECK(bad == 0);
+
+    // empty range does not run anything
+    std::atomic<int> count(0);
+    ic::pfor(0, 1, [&](int, int) { ++count; });
+    CHECK(count == 0);
+}
+
+// Tasks spawned from inside tasks, and groups waited on from pool threads.
+static void TestTaskGroups()
+{
+    std::atomic<int> leaves(0);
+    ic::TaskGroup outer;
+    for (int i = 0; i < 8; ++i)
+    {
+        outer.spawn([&](int thread_idx) {
+            {
+                ThreadIndexGuard guard(thread_idx);
+            }
+            ic::TaskGroup inner;
+            for (int j = 0; j < 8; ++j)
+            {
+                inner.spawn([&](int inner_idx) {
+                    ThreadIndexGuard guard(inner_idx);
+                    Work(500);
+                    ++leaves;
+                    });
+            }
+            inner.wait();
+            });
+    }
+    outer.wait();
+    CHECK(leaves == 64);
+    CHECK(outer.pending == 0);
+}
+
+// Every index exactly once, for guided (step 0) and fixed range sizes, with both
+// schedules; some indices take much longer than others, so that ranges get split.
+static void TestSchedules()
+{
+    bool all_once = true;
+    for (unsigned count : {1u, 2u, 5u, 63u, 64u, 65u, 1000u, 12345u})
+    {
+        for (unsigned step : {0u, 1u, 3u, 100u})
+        {
+            for (ic::Schedule schedule : {ic::ScheduleDynamic, ic::ScheduleContiguous})
+            {
+                std::vector<std::atomic<int>> hits(count);
+                ic::pfor(count, step, [&](int i, int thread_idx) {
+                    ThreadIndexGuard guard(thread_idx);
+                    ++hits[i];
+                    if (i % 97 == 0)
+                        Work(2000);
+                    }, schedule);
+                for (const std::atomic<int>& h : hits)
+                    all_once &= h == 1;
+            }
+        }
+    }
+    CHECK(all_once);
+}
+
+// Idle threads spin for a while and then sleep; work queued after they went to sleep
+// has to wake them (a lost wakeup would hang here), also when posted from several
+// threads right as others go idle.
+static void TestWakeup()
+{
+    for (int cycle = 0; cycle < 20; ++cycle)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(cycle % 4 == 0 ? 20 : 1));
+        std::atomic<int> count(0);
+        ic::pfor(64, 1, [&](int, int) { ++count; });
+        CHECK(count == 64);
+        std::future<int> value = RunAsync([]() { return 42; });
+        CHECK(value.get() == 42);
+    }
+    std::vector<std::thread> posters;
+    std::atomic<int> total(0);
+    for (int t = 0; t < 3; ++t)
+    {
+        posters.emplace_back([&, t]() {
+            for (int i = 0; i < 200; ++i)
+            {
+                if ((i + t) % 50 == 0)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                ic::TaskGroup group;
+                group.spawn([&](int) { ++total; });
+                group.wait();
+            }
+            });
+    }
+    for (std::thread& t : posters)
+        t.join();
+    CHECK(total == 600);
+}
+
+// NUMA nodes list the CPUs this process may use; a pool with pinned threads runs
+// work like any other.
+static void TestPinnedPool()
+{
+    const std::vector<std::vector<int>> nodes = sysinfo_getnumanodes();
+    CHECK(!nodes.empty());
+    size_t cpu_count = 0;
+    for (const std::vector<int>& cpus : nodes)
+        cpu_count += cpus.size();
+    CHECK(cpu_count >= 1);
+    InitThreading(4, true);
+    std::atomic<int> count(0);
+    ic::pfor(1000, 1, [&](int, int thread_idx) {
+        ThreadIndexGuard guard(thread_idx);
+        ++count;
+        });
+    CHECK(count == 1000);
+    TestTaskGroups();
+    ShutdownThreading();
+}
+
+// Available cores: at least one, no more than the physical cores or the CPUs in the
+// affinity mask; a thread pinned to one CPU has one core available.
+static void TestAvailableCores()
+{
+    const unsigned available = sysinfo_getavailablecores();
+    const unsigned physical = sysinfo_getcpuphysicalcores();
+    const unsigned logical = std::thread::hardware_concurrency();
+    CHECK(available >= 1);
+    CHECK(physical == 0 || available <= physical);
+    CHECK(logical == 0 || available <= logical);
+    const std::vector<std::vector<int>> nodes = sysinfo_getnumanodes();
+    if (!nodes.empty() && !nodes[0].empty())
+    {
+        unsigned pinned_available = 0;
+        bool pinned = false;
+        std::thread thread([&]() {
+            pinned = sysinfo_pinthread(nodes[0][0]);
+            pinned_available = sysinfo_getavailablecores();
+            });
+        thread.join();
+#ifdef __linux
+        CHECK(pinned && pinned_available == 1);
+#else
+        CHECK(!pinned || pinned_available >= 1);
+#endif
+    }
+}
+
+// Pool statistics count the work done since the last reset.
+static void TestStats()
+{
+    InitThreading(3);
+    ResetThreadingStats();
+    ic::pfor(100, 1, [&](int, int) { Work(20000); });
+    ic::TaskGroup group;
+    for (int i = 0; i < 10; ++i)
+        group.spawn([](int) { Work(20000); });
+    group.wait();
+    const ThreadingStats stats = GetThreadingStats();
+    CHECK(stats.tasks >= 11 && stats.busy_time > 0 && stats.idle_time >= 0 && stats.tail_time >= 0);
+    ShutdownThreading();
+}
+
+int main()
+{
+    for (int threads : {1, 2, 3, 8})
+    {
+        InitThreading(threads);
+        CHECK(GetThreadCount() == threads);
+        TestNestedAndConcurrent();
+        TestTaskGroups();
+        TestSchedules();
+        TestWakeup();
+        ShutdownThreading();
+    }
+    TestPinnedPool();
+    TestAvailableCores();
+    TestStats();
+    CHECK(s_bad_index == 0);
+    return TestResult();
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+// Shared helpers for the test executables: a CHECK macro that counts failures,
+// and test images. Each test's main returns TestResult().
+
+#include "image.h"
+
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+inline int& TestFailures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(expr) do { if (!(expr)) { printf("FAIL %s:%i: %s\n", __FILE__, __LINE__, #expr); ++TestFailures(); } } while (0)
+
+// Prints the summary; returns the process exit code.
+inline int TestResult()
+{
+    printf("%s (%i failures)\n", TestFailures() ? "FAILED" : "OK", TestFailures());
+    return TestFailures() != 0;
+}
+
+// Image with one channel per character of types ('h' = fp16, 'f' = fp32), named like
+// EXR layers ("LA.R", "LA.S", "LA.T", "LB.R", ...). Every 7 pixels, 3 are zero so that
+// chunks are not all noise.
+inline Image MakeNoiseImage(size_t width, size_t height, const char* types, unsigned seed)
+{
+    Image img;
+    img.width = width;
+    img.height = height;
+    size_t pixel_size = 0;
+    for (int i = 0; types[i]; ++i)
+    {
+        const bool fp16 = types[i] == 'h';
+        img.channels.push_back({std::string("L") + char('A' + i / 3) + "." + char('R' + i % 3), fp16, pixel_size});
+        pixel_size += fp16 ? 2 : 4;
+    }
+    img.pixels_size = width * height * pixel_size;
+    img.pixels = MakePixelBuffer(img.pixels_size);
+    srand(seed);
+    for (size_t i = 0; i < img.pixels_size; ++i)
+        img.pixels[i] = (i / pixel_size) % 7 < 3 ? 0 : char(rand());
+    return img;
+}
+
+// Image with named channels and only normal (non-zero, non-subnormal, finite) values,
+// which EXR and JXL store losslessly.
+inline Image MakeNormalImage(size_t width, size_t height, const std::vector<std::pair<std::string, bool>>& channels, unsigned seed)
+{
+    Image img;
+    img.width = width;
+    img.height = height;
+    size_t pixel_size = 0;
+    for (const auto& ch : channels)
+    {
+        img.channels.push_back({ch.first, ch.second, pixel_size});
+        pixel_size += ch.second ? 2 : 4;
+    }
+    img.pixels_size = width * height * pixel_size;
+    img.pixels = MakePixelBuffer(img.pixels_size);
+    srand(seed);
+    for (size_t i = 0; i < width * height; ++i)
+    {
+        for (const Image::Channel& ch : img.channels)
+        {
+            char* dst = img.pixels.get() + i * pixel_size + ch.offset;
+            if (ch.fp16)
+            {
+                const uint16_t v = uint16_t(((rand() & 1) << 15) | ((1 + rand() % 30) << 10) | (rand() & 0x3ff));
+                memcpy(dst, &v, 2);
+            }
+            else
+            {
+                const uint32_t v = uint32_t(rand() & 1) << 31 | uint32_t(1 + rand() % 254) << 23 | (uint32_t(rand()) & 0x7fffff);
+                memcpy(dst, &v, 4);
+            }
+        }
+    }
+    return img;
+}
+
+inline bool SamePixels(const Image& a, const Image& b)
+{
+    return a.width == b.width && a.height == b.height && a.pixels_size == b.pixels_size &&
+        memcmp(a.pixels.get(), b.pixels.get(), a.pixels_size) == 0;
+}
+
+// Pixel (x, y) of the given channel, as raw bits; ~0 if there is no such channel.
+inline uint32_t ChannelBits(const Image& img, const std::string& name, size_t x, size_t y)
+{
+    const size_t stride = img.pixels_size / (img.width * img.height);
+    for (const Image::Channel& ch : img.channels)
+    {
+        if (ch.name == name)
+        {
+            uint32_t v = 0;
+            memcpy(&v, img.pixels.get() + (y * img.width + x) * stride + ch.offset, ch.fp16 ? 2 : 4);
+            return v;
+        }
+    }
+    return ~0u;
+}
+
+// Checks that region matches the (x0, y0) based rectangle of the full image, for the
+// channels present in region.
+inline bool SameRegion(const Image& full, const Image& region, size_t x0, size_t y0)
+{
+    for (const Image::Channel& ch : region.channels)
+    {
+        for (size_t y = 0; y < region.height; ++y)
+        {
+            for (size_t x = 0; x < region.width; ++x)
+            {
+                if (ChannelBits(region, ch.name, x, y) != ChannelBits(full, ch.name, x0 + x, y0 + y))
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Compares channels by name, since codecs may reorder them (EXR sorts by name).
+inline bool SameChannelsByName(const Image& a, const Image& b)
+{
+    if (a.width != b.width || a.height != b.height || a.channels.size() != b.channels.size())
+        return false;
+    for (const Image::Channel& ch : a.channels)
+    {
+        for (size_t y = 0; y < a.height; ++y)
+        {
+            for (size_t x = 0; x < a.width; ++x)
+            {
+                if (ChannelBits(a, ch.name, x, y) != ChannelBits(b, ch.name, x, y))
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+// Same pixels as img, in a planar buffer (each channel's plane after the previous one).
+// The view points into planar, which has to stay alive while it is used.
+inline ImageView MakePlanarCopy(const Image& img, std::unique_ptr<char[]>& planar)
+{
+    const size_t pixel_count = img.width * img.height;
+    const size_t pixel_size = img.pixels_size / pixel_count;
+    planar.reset(new char[img.pixels_size]);
+    ImageView view;
+    view.width = img.width;
+    view.height = img.height;
+    size_t offset = 0;
+    for (const Image::Channel& ch : img.channels)
+    {
+        const size_t size = ch.fp16 ? 2 : 4;
+        view.channels.push_back({ch.name, ch.fp16, planar.get() + offset, size, size * img.width});
+        for (size_t i = 0; i < pixel_count; ++i)
+            memcpy(planar.get() + offset + i * size, img.pixels.get() + i * pixel_size + ch.offset, size);
+        offset += pixel_count * size;
+    }
+    return view;
+}